@@ -0,0 +1,1135 @@
+/* */
+
+/*
+ * Copyright (c) 2026 David Gwynne <david@gwynne.id.au>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <math.h>
+
+#include <lua.h>
+#include <lauxlib.h>
+
+#include "lua_json.h"
+
+#define JSON_R_MAXDEPTH		64
+
+/*
+ * writer
+ */
+
+static void
+json_w_putn(struct json_writer *jw, const char *s, size_t n)
+{
+	size_t len;
+	char *buf;
+
+	if (jw->jw_error)
+		return;
+
+	if (jw->jw_len - jw->jw_off < n) {
+		if (!jw->jw_grow) {
+			jw->jw_error = 1;
+			return;
+		}
+
+		len = jw->jw_len;
+		do {
+			len *= 2;
+		} while (len - jw->jw_off < n);
+
+		buf = realloc(jw->jw_buf, len);
+		if (buf == NULL) {
+			jw->jw_error = 1;
+			return;
+		}
+
+		jw->jw_buf = buf;
+		jw->jw_len = len;
+	}
+
+	memcpy(jw->jw_buf + jw->jw_off, s, n);
+	jw->jw_off += n;
+}
+
+static inline void
+json_w_putc(struct json_writer *jw, char c)
+{
+	json_w_putn(jw, &c, 1);
+}
+
+static void
+json_w_escape(struct json_writer *jw, const char *s, size_t n)
+{
+	static const char hex[] = "0123456789abcdef";
+	char u[6] = { '\\', 'u', '0', '0' };
+	size_t i, start = 0;
+	const char *e;
+	size_t elen;
+	unsigned char c;
+
+	json_w_putc(jw, '"');
+	for (i = 0; i < n; i++) {
+		c = s[i];
+		if (c >= 0x20 && c != '"' && c != '\\')
+			continue;
+
+		json_w_putn(jw, s + start, i - start);
+		start = i + 1;
+
+		elen = 2;
+		switch (c) {
+		case '"':
+			e = "\\\"";
+			break;
+		case '\\':
+			e = "\\\\";
+			break;
+		case '\b':
+			e = "\\b";
+			break;
+		case '\f':
+			e = "\\f";
+			break;
+		case '\n':
+			e = "\\n";
+			break;
+		case '\r':
+			e = "\\r";
+			break;
+		case '\t':
+			e = "\\t";
+			break;
+		default:
+			u[4] = hex[c >> 4];
+			u[5] = hex[c & 0xf];
+			e = u;
+			elen = sizeof(u);
+			break;
+		}
+		json_w_putn(jw, e, elen);
+	}
+	json_w_putn(jw, s + start, n - start);
+	json_w_putc(jw, '"');
+}
+
+/* the separator and key that go in front of every value */
+static void
+json_w_prefix(struct json_writer *jw, const char *key, size_t keylen)
+{
+	uint32_t bit = 1U << jw->jw_depth;
+
+	if (jw->jw_more & bit)
+		json_w_putc(jw, ',');
+	jw->jw_more |= bit;
+
+	if (key != NULL) {
+		json_w_escape(jw, key, keylen);
+		json_w_putc(jw, ':');
+	}
+}
+
+static inline void
+json_w_key(struct json_writer *jw, const char *key)
+{
+	json_w_prefix(jw, key, key == NULL ? 0 : strlen(key));
+}
+
+static void
+json_w_open(struct json_writer *jw, char c)
+{
+	json_w_putc(jw, c);
+
+	if (jw->jw_depth + 1 >= JSON_W_MAXDEPTH) {
+		jw->jw_error = 1;
+		return;
+	}
+
+	jw->jw_depth++;
+	jw->jw_more &= ~(1U << jw->jw_depth);
+}
+
+static void
+json_w_close(struct json_writer *jw, char c)
+{
+	if (jw->jw_depth == 0) {
+		jw->jw_error = 1;
+		return;
+	}
+
+	jw->jw_depth--;
+	json_w_putc(jw, c);
+}
+
+void
+json_w_init(struct json_writer *jw, char *buf, size_t len)
+{
+	jw->jw_buf = buf;
+	jw->jw_len = len;
+	jw->jw_off = 0;
+	jw->jw_grow = 0;
+	jw->jw_error = 0;
+	jw->jw_depth = 0;
+	jw->jw_more = 0;
+}
+
+int
+json_w_init_grow(struct json_writer *jw, size_t len)
+{
+	char *buf;
+
+	buf = malloc(len);
+	if (buf == NULL)
+		return (-1);
+
+	json_w_init(jw, buf, len);
+	jw->jw_grow = 1;
+
+	return (0);
+}
+
+void
+json_w_free(struct json_writer *jw)
+{
+	if (jw->jw_grow) {
+		free(jw->jw_buf);
+		jw->jw_buf = NULL;
+		jw->jw_grow = 0;
+	}
+}
+
+int
+json_w_finish(struct json_writer *jw, const char **buf, size_t *len)
+{
+	if (jw->jw_error || jw->jw_depth != 0)
+		return (-1);
+
+	*buf = jw->jw_buf;
+	*len = jw->jw_off;
+
+	return (0);
+}
+
+void
+json_w_object(struct json_writer *jw, const char *key)
+{
+	json_w_key(jw, key);
+	json_w_open(jw, '{');
+}
+
+void
+json_w_array(struct json_writer *jw, const char *key)
+{
+	json_w_key(jw, key);
+	json_w_open(jw, '[');
+}
+
+void
+json_w_end_object(struct json_writer *jw)
+{
+	json_w_close(jw, '}');
+}
+
+void
+json_w_end_array(struct json_writer *jw)
+{
+	json_w_close(jw, ']');
+}
+
+void
+json_w_string(struct json_writer *jw, const char *key,
+    const char *s, size_t len)
+{
+	json_w_key(jw, key);
+	json_w_escape(jw, s, len);
+}
+
+void
+json_w_str(struct json_writer *jw, const char *key, const char *s)
+{
+	json_w_string(jw, key, s, strlen(s));
+}
+
+void
+json_w_int(struct json_writer *jw, const char *key, long long v)
+{
+	char buf[32];
+	int rv;
+
+	json_w_key(jw, key);
+	rv = snprintf(buf, sizeof(buf), "%lld", v);
+	json_w_putn(jw, buf, rv);
+}
+
+void
+json_w_uint(struct json_writer *jw, const char *key, unsigned long long v)
+{
+	char buf[32];
+	int rv;
+
+	json_w_key(jw, key);
+	rv = snprintf(buf, sizeof(buf), "%llu", v);
+	json_w_putn(jw, buf, rv);
+}
+
+static void
+json_w_double(struct json_writer *jw, double v)
+{
+	char buf[32];
+	int rv;
+
+	/* json has no way to say inf or nan */
+	if (!isfinite(v)) {
+		json_w_putn(jw, "null", 4);
+		return;
+	}
+
+	rv = snprintf(buf, sizeof(buf), "%.14g", v);
+	json_w_putn(jw, buf, rv);
+}
+
+void
+json_w_number(struct json_writer *jw, const char *key, double v)
+{
+	json_w_key(jw, key);
+	json_w_double(jw, v);
+}
+
+void
+json_w_bool(struct json_writer *jw, const char *key, int v)
+{
+	json_w_key(jw, key);
+	if (v)
+		json_w_putn(jw, "true", 4);
+	else
+		json_w_putn(jw, "false", 5);
+}
+
+void
+json_w_null(struct json_writer *jw, const char *key)
+{
+	json_w_key(jw, key);
+	json_w_putn(jw, "null", 4);
+}
+
+/*
+ * encoding lua values
+ */
+
+static const char *
+lua_json_enc(lua_State *, struct json_writer *, int, const char *, size_t);
+
+static int
+lua_json_isarray(lua_State *L, int idx, lua_Integer *np)
+{
+	lua_Integer n, i = 0;
+	lua_Integer k;
+
+	n = lua_rawlen(L, idx);
+	if (n == 0)
+		return (0);
+
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0) {
+		lua_pop(L, 1);
+		if (!lua_isinteger(L, -1)) {
+			lua_pop(L, 1);
+			return (0);
+		}
+		k = lua_tointeger(L, -1);
+		if (k < 1 || k > n) {
+			lua_pop(L, 1);
+			return (0);
+		}
+		i++;
+	}
+
+	*np = n;
+	return (i == n);
+}
+
+static const char *
+lua_json_enc_table(lua_State *L, struct json_writer *jw, int idx)
+{
+	lua_Integer i, n;
+	const char *key;
+	size_t keylen;
+	const char *errstr;
+
+	if (!lua_checkstack(L, 4))
+		return ("stack overflow");
+	if (jw->jw_depth + 1 >= JSON_W_MAXDEPTH)
+		return ("table nested too deep (or it has a cycle)");
+
+	if (lua_json_isarray(L, idx, &n)) {
+		json_w_open(jw, '[');
+		for (i = 1; i <= n; i++) {
+			lua_rawgeti(L, idx, i);
+			errstr = lua_json_enc(L, jw, lua_gettop(L), NULL, 0);
+			lua_pop(L, 1);
+			if (errstr != NULL)
+				return (errstr);
+		}
+		json_w_close(jw, ']');
+		return (NULL);
+	}
+
+	json_w_open(jw, '{');
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0) {
+		int vidx = lua_gettop(L);
+
+		switch (lua_type(L, -2)) {
+		case LUA_TSTRING:
+			key = lua_tolstring(L, -2, &keylen);
+			break;
+		case LUA_TNUMBER:
+			/* dont convert the key in place, it upsets lua_next */
+			lua_pushvalue(L, -2);
+			key = lua_tolstring(L, -1, &keylen);
+			break;
+		default:
+			lua_pop(L, 2);
+			return ("table keys must be strings or numbers");
+		}
+
+		errstr = lua_json_enc(L, jw, vidx, key, keylen);
+		if (errstr != NULL) {
+			lua_settop(L, vidx - 2);
+			return (errstr);
+		}
+		lua_settop(L, vidx - 1);
+	}
+	json_w_close(jw, '}');
+
+	return (NULL);
+}
+
+static const char *
+lua_json_enc(lua_State *L, struct json_writer *jw, int idx,
+    const char *key, size_t keylen)
+{
+	const char *s;
+	size_t len;
+
+	json_w_prefix(jw, key, keylen);
+
+	switch (lua_type(L, idx)) {
+	case LUA_TNIL:
+		json_w_putn(jw, "null", 4);
+		break;
+	case LUA_TBOOLEAN:
+		if (lua_toboolean(L, idx))
+			json_w_putn(jw, "true", 4);
+		else
+			json_w_putn(jw, "false", 5);
+		break;
+	case LUA_TNUMBER:
+		if (lua_isinteger(L, idx)) {
+			char buf[32];
+			int rv;
+
+			rv = snprintf(buf, sizeof(buf), LUA_INTEGER_FMT,
+			    (LUAI_UACINT)lua_tointeger(L, idx));
+			json_w_putn(jw, buf, rv);
+		} else
+			json_w_double(jw, lua_tonumber(L, idx));
+		break;
+	case LUA_TSTRING:
+		s = lua_tolstring(L, idx, &len);
+		json_w_escape(jw, s, len);
+		break;
+	case LUA_TLIGHTUSERDATA:
+		if (lua_touserdata(L, idx) != NULL)
+			return ("cannot encode userdata");
+		json_w_putn(jw, "null", 4); /* json.null */
+		break;
+	case LUA_TTABLE:
+		return (lua_json_enc_table(L, jw, idx));
+	default:
+		return ("cannot encode functions, userdata, or threads");
+	}
+
+	return (NULL);
+}
+
+static const char lua_json_writer_type[] = "_lua_json_writer";
+
+static int
+lua_json_writer__gc(lua_State *L)
+{
+	json_w_free(lua_touserdata(L, 1));
+
+	return (0);
+}
+
+/*
+ * encode the value at idx and push the resulting string on the stack.
+ *
+ * lua can raise an error anywhere in the walk, so the writer lives
+ * in a userdata and its buffer is freed by __gc if that happens.
+ */
+const char *
+lua_json_encode(lua_State *L, int idx, size_t *len)
+{
+	struct json_writer *jw;
+	const char *errstr;
+	const char *buf;
+	size_t buflen;
+	int top;
+
+	idx = lua_absindex(L, idx);
+	top = lua_gettop(L);
+
+	jw = lua_newuserdata(L, sizeof(*jw));
+	json_w_init(jw, NULL, 0);
+	if (luaL_newmetatable(L, lua_json_writer_type)) {
+		lua_pushcfunction(L, lua_json_writer__gc);
+		lua_setfield(L, -2, "__gc");
+	}
+	lua_setmetatable(L, -2);
+
+	if (json_w_init_grow(jw, 256) == -1)
+		luaL_error(L, "json encode: out of memory");
+
+	errstr = lua_json_enc(L, jw, idx, NULL, 0);
+	if (errstr != NULL) {
+		json_w_free(jw);
+		luaL_error(L, "json encode: %s", errstr);
+	}
+
+	if (json_w_finish(jw, &buf, &buflen) == -1) {
+		json_w_free(jw);
+		luaL_error(L, "json encode: out of memory");
+	}
+
+	lua_pushlstring(L, buf, buflen);
+	json_w_free(jw);
+	lua_replace(L, top + 1);
+	lua_settop(L, top + 1);
+
+	return (lua_tolstring(L, -1, len));
+}
+
+/*
+ * decoder
+ */
+
+struct json_r {
+	lua_State	*L;
+	const char	*s;
+	size_t		 len;
+	size_t		 off;
+};
+
+static void __dead
+json_r_error(struct json_r *r, const char *msg)
+{
+	luaL_error(r->L, "json decode: %s at offset %d", msg, (int)r->off);
+	abort(); /* NOTREACHED */
+}
+
+static inline void
+json_r_ws(struct json_r *r)
+{
+	while (r->off < r->len) {
+		switch (r->s[r->off]) {
+		case ' ':
+		case '\t':
+		case '\n':
+		case '\r':
+			r->off++;
+			break;
+		default:
+			return;
+		}
+	}
+}
+
+static inline int
+json_r_peek(struct json_r *r)
+{
+	json_r_ws(r);
+	if (r->off >= r->len)
+		json_r_error(r, "unexpected end of input");
+
+	return ((unsigned char)r->s[r->off]);
+}
+
+static void
+json_r_expect(struct json_r *r, char c)
+{
+	if (json_r_peek(r) != c)
+		json_r_error(r, "unexpected character");
+	r->off++;
+}
+
+static void
+json_r_literal(struct json_r *r, const char *lit, size_t len)
+{
+	if (r->len - r->off < len || memcmp(r->s + r->off, lit, len) != 0)
+		json_r_error(r, "invalid literal");
+	r->off += len;
+}
+
+static unsigned int
+json_r_hex4(struct json_r *r)
+{
+	unsigned int v = 0;
+	unsigned int i;
+	int c;
+
+	if (r->len - r->off < 4)
+		json_r_error(r, "truncated \\u escape");
+
+	for (i = 0; i < 4; i++) {
+		c = r->s[r->off++];
+		v <<= 4;
+		if (c >= '0' && c <= '9')
+			v |= c - '0';
+		else if (c >= 'a' && c <= 'f')
+			v |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			v |= c - 'A' + 10;
+		else
+			json_r_error(r, "invalid \\u escape");
+	}
+
+	return (v);
+}
+
+static void
+json_r_utf8(luaL_Buffer *b, unsigned int cp)
+{
+	if (cp < 0x80)
+		luaL_addchar(b, cp);
+	else if (cp < 0x800) {
+		luaL_addchar(b, 0xc0 | (cp >> 6));
+		luaL_addchar(b, 0x80 | (cp & 0x3f));
+	} else if (cp < 0x10000) {
+		luaL_addchar(b, 0xe0 | (cp >> 12));
+		luaL_addchar(b, 0x80 | ((cp >> 6) & 0x3f));
+		luaL_addchar(b, 0x80 | (cp & 0x3f));
+	} else {
+		luaL_addchar(b, 0xf0 | (cp >> 18));
+		luaL_addchar(b, 0x80 | ((cp >> 12) & 0x3f));
+		luaL_addchar(b, 0x80 | ((cp >> 6) & 0x3f));
+		luaL_addchar(b, 0x80 | (cp & 0x3f));
+	}
+}
+
+/* push the string starting at the opening quote */
+static void
+json_r_string(struct json_r *r)
+{
+	luaL_Buffer b;
+	size_t start;
+	unsigned int cp, lo;
+	int c;
+
+	r->off++; /* skip " */
+	start = r->off;
+
+	/* most strings have no escapes, so push them straight from s */
+	for (;;) {
+		if (r->off >= r->len)
+			json_r_error(r, "unterminated string");
+		c = (unsigned char)r->s[r->off];
+		if (c == '"') {
+			lua_pushlstring(r->L, r->s + start, r->off - start);
+			r->off++;
+			return;
+		}
+		if (c == '\\')
+			break;
+		if (c < 0x20)
+			json_r_error(r, "control character in string");
+		r->off++;
+	}
+
+	luaL_buffinit(r->L, &b);
+	luaL_addlstring(&b, r->s + start, r->off - start);
+
+	for (;;) {
+		if (r->off >= r->len)
+			json_r_error(r, "unterminated string");
+		c = (unsigned char)r->s[r->off++];
+		if (c == '"')
+			break;
+		if (c < 0x20)
+			json_r_error(r, "control character in string");
+		if (c != '\\') {
+			luaL_addchar(&b, c);
+			continue;
+		}
+
+		if (r->off >= r->len)
+			json_r_error(r, "unterminated string");
+		c = r->s[r->off++];
+		switch (c) {
+		case '"':
+		case '\\':
+		case '/':
+			luaL_addchar(&b, c);
+			break;
+		case 'b':
+			luaL_addchar(&b, '\b');
+			break;
+		case 'f':
+			luaL_addchar(&b, '\f');
+			break;
+		case 'n':
+			luaL_addchar(&b, '\n');
+			break;
+		case 'r':
+			luaL_addchar(&b, '\r');
+			break;
+		case 't':
+			luaL_addchar(&b, '\t');
+			break;
+		case 'u':
+			cp = json_r_hex4(r);
+			if (cp >= 0xd800 && cp <= 0xdbff) {
+				if (r->len - r->off >= 6 &&
+				    r->s[r->off] == '\\' &&
+				    r->s[r->off + 1] == 'u') {
+					r->off += 2;
+					lo = json_r_hex4(r);
+					if (lo >= 0xdc00 && lo <= 0xdfff) {
+						cp = 0x10000 +
+						    ((cp - 0xd800) << 10) +
+						    (lo - 0xdc00);
+					} else
+						cp = 0xfffd;
+				} else
+					cp = 0xfffd;
+			} else if (cp >= 0xdc00 && cp <= 0xdfff)
+				cp = 0xfffd;
+			json_r_utf8(&b, cp);
+			break;
+		default:
+			json_r_error(r, "invalid escape");
+		}
+	}
+
+	luaL_pushresult(&b);
+}
+
+static int
+json_r_is(struct json_r *r, const char *set)
+{
+	return (r->off < r->len && r->s[r->off] != '\0' &&
+	    strchr(set, r->s[r->off]) != NULL);
+}
+
+static size_t
+json_r_digits(struct json_r *r)
+{
+	size_t start = r->off;
+
+	while (json_r_is(r, "0123456789"))
+		r->off++;
+
+	return (r->off - start);
+}
+
+/* -?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)? */
+static void
+json_r_number(struct json_r *r)
+{
+	size_t start = r->off;
+	size_t len;
+	int isint = 1;
+	lua_Integer v = 0;
+	char buf[64];
+	char *end;
+
+	if (json_r_is(r, "-"))
+		r->off++;
+
+	if (json_r_is(r, "0")) {
+		r->off++;
+		if (json_r_is(r, "0123456789"))
+			json_r_error(r, "invalid number");
+	} else if (json_r_digits(r) == 0)
+		json_r_error(r, "invalid number");
+
+	if (json_r_is(r, ".")) {
+		isint = 0;
+		r->off++;
+		if (json_r_digits(r) == 0)
+			json_r_error(r, "invalid number");
+	}
+
+	if (json_r_is(r, "eE")) {
+		isint = 0;
+		r->off++;
+		if (json_r_is(r, "+-"))
+			r->off++;
+		if (json_r_digits(r) == 0)
+			json_r_error(r, "invalid number");
+	}
+
+	len = r->off - start;
+
+	/* up to 18 digits fit in an int64 without checking for overflow */
+	if (isint && len <= 18) {
+		size_t i = start;
+		int neg = 0;
+
+		if (r->s[i] == '-') {
+			neg = 1;
+			i++;
+		}
+		for (; i < r->off; i++)
+			v = (v * 10) + (r->s[i] - '0');
+
+		lua_pushinteger(r->L, neg ? -v : v);
+		return;
+	}
+
+	if (len >= sizeof(buf))
+		json_r_error(r, "number too long");
+	memcpy(buf, r->s + start, len);
+	buf[len] = '\0';
+
+	lua_pushnumber(r->L, strtod(buf, &end));
+	if (*end != '\0')
+		json_r_error(r, "invalid number");
+}
+
+static void
+json_r_value(struct json_r *r, unsigned int depth)
+{
+	lua_State *L = r->L;
+	lua_Integer i;
+
+	switch (json_r_peek(r)) {
+	case '{':
+		if (depth >= JSON_R_MAXDEPTH)
+			json_r_error(r, "nested too deep");
+		luaL_checkstack(L, 3, "json decode");
+
+		r->off++;
+		lua_newtable(L);
+		if (json_r_peek(r) == '}') {
+			r->off++;
+			break;
+		}
+		for (;;) {
+			if (json_r_peek(r) != '"')
+				json_r_error(r, "expected string key");
+			json_r_string(r);
+			json_r_expect(r, ':');
+			json_r_value(r, depth + 1);
+			lua_rawset(L, -3);
+
+			if (json_r_peek(r) == ',') {
+				r->off++;
+				continue;
+			}
+			json_r_expect(r, '}');
+			break;
+		}
+		break;
+	case '[':
+		if (depth >= JSON_R_MAXDEPTH)
+			json_r_error(r, "nested too deep");
+		luaL_checkstack(L, 3, "json decode");
+
+		r->off++;
+		lua_newtable(L);
+		if (json_r_peek(r) == ']') {
+			r->off++;
+			break;
+		}
+		for (i = 1;; i++) {
+			json_r_value(r, depth + 1);
+			lua_rawseti(L, -2, i);
+
+			if (json_r_peek(r) == ',') {
+				r->off++;
+				continue;
+			}
+			json_r_expect(r, ']');
+			break;
+		}
+		break;
+	case '"':
+		json_r_string(r);
+		break;
+	case 't':
+		json_r_literal(r, "true", 4);
+		lua_pushboolean(L, 1);
+		break;
+	case 'f':
+		json_r_literal(r, "false", 5);
+		lua_pushboolean(L, 0);
+		break;
+	case 'n':
+		json_r_literal(r, "null", 4);
+		lua_pushlightuserdata(L, NULL); /* json.null */
+		break;
+	default:
+		json_r_number(r);
+		break;
+	}
+}
+
+/*
+ * skipping values lets json.get() find one field without building
+ * lua values for the rest of the document.
+ */
+
+static void
+json_r_skip_string(struct json_r *r)
+{
+	int c;
+
+	r->off++; /* skip " */
+	for (;;) {
+		if (r->off >= r->len)
+			json_r_error(r, "unterminated string");
+		c = r->s[r->off++];
+		if (c == '"')
+			return;
+		if (c == '\\')
+			r->off++;
+	}
+}
+
+static void
+json_r_skip(struct json_r *r, unsigned int depth)
+{
+	int open, close;
+
+	switch (json_r_peek(r)) {
+	case '{':
+		open = '{';
+		close = '}';
+		break;
+	case '[':
+		open = '[';
+		close = ']';
+		break;
+	case '"':
+		json_r_skip_string(r);
+		return;
+	case 't':
+		json_r_literal(r, "true", 4);
+		return;
+	case 'f':
+		json_r_literal(r, "false", 5);
+		return;
+	case 'n':
+		json_r_literal(r, "null", 4);
+		return;
+	default:
+		json_r_number(r);
+		lua_pop(r->L, 1);
+		return;
+	}
+
+	if (depth >= JSON_R_MAXDEPTH)
+		json_r_error(r, "nested too deep");
+
+	r->off++;
+	if (json_r_peek(r) == close) {
+		r->off++;
+		return;
+	}
+	for (;;) {
+		if (open == '{') {
+			if (json_r_peek(r) != '"')
+				json_r_error(r, "expected string key");
+			json_r_skip_string(r);
+			json_r_expect(r, ':');
+		}
+		json_r_skip(r, depth + 1);
+
+		if (json_r_peek(r) == ',') {
+			r->off++;
+			continue;
+		}
+		json_r_expect(r, close);
+		return;
+	}
+}
+
+/* is the object key at r->off the same as key? */
+static int
+json_r_key(struct json_r *r, const char *key, size_t keylen)
+{
+	size_t start = r->off + 1;
+	const char *s;
+	size_t len;
+	int rv;
+
+	json_r_skip_string(r);
+	len = r->off - 1 - start;
+
+	if (memchr(r->s + start, '\\', len) == NULL) {
+		return (len == keylen &&
+		    memcmp(r->s + start, key, keylen) == 0);
+	}
+
+	/* escaped keys are rare enough to decode properly */
+	r->off = start - 1;
+	json_r_string(r);
+	s = lua_tolstring(r->L, -1, &len);
+	rv = (len == keylen && memcmp(s, key, keylen) == 0);
+	lua_pop(r->L, 1);
+
+	return (rv);
+}
+
+/* move r to the value for key in the object at r->off */
+static int
+json_r_find_key(struct json_r *r, const char *key, size_t keylen)
+{
+	if (json_r_peek(r) != '{')
+		return (0);
+
+	r->off++;
+	if (json_r_peek(r) == '}')
+		return (0);
+
+	for (;;) {
+		if (json_r_peek(r) != '"')
+			json_r_error(r, "expected string key");
+		if (json_r_key(r, key, keylen)) {
+			json_r_expect(r, ':');
+			return (1);
+		}
+		json_r_expect(r, ':');
+		json_r_skip(r, 1);
+
+		if (json_r_peek(r) == ',') {
+			r->off++;
+			continue;
+		}
+		json_r_expect(r, '}');
+		return (0);
+	}
+}
+
+/* move r to element n (from 1) in the array at r->off */
+static int
+json_r_find_index(struct json_r *r, lua_Integer n)
+{
+	lua_Integer i;
+
+	if (json_r_peek(r) != '[' || n < 1)
+		return (0);
+
+	r->off++;
+	if (json_r_peek(r) == ']')
+		return (0);
+
+	for (i = 1; i < n; i++) {
+		json_r_skip(r, 1);
+
+		if (json_r_peek(r) == ',') {
+			r->off++;
+			continue;
+		}
+		json_r_expect(r, ']');
+		return (0);
+	}
+
+	return (1);
+}
+
+/*
+ * lua interface
+ */
+
+static int
+lua_json_decode(lua_State *L)
+{
+	struct json_r r = { .L = L };
+
+	r.s = luaL_checklstring(L, 1, &r.len);
+
+	json_r_value(&r, 0);
+
+	json_r_ws(&r);
+	if (r.off != r.len)
+		json_r_error(&r, "trailing garbage");
+
+	return (1);
+}
+
+/*
+ * json.get(doc, key, ...) walks the path of object keys and array
+ * indexes and only decodes the value at the end of it.
+ */
+static int
+lua_json_get(lua_State *L)
+{
+	struct json_r r = { .L = L };
+	int i, n = lua_gettop(L);
+	const char *key;
+	size_t keylen;
+
+	r.s = luaL_checklstring(L, 1, &r.len);
+
+	for (i = 2; i <= n; i++) {
+		if (lua_type(L, i) == LUA_TSTRING) {
+			key = lua_tolstring(L, i, &keylen);
+			if (!json_r_find_key(&r, key, keylen))
+				return (0);
+		} else if (lua_isinteger(L, i)) {
+			if (!json_r_find_index(&r, lua_tointeger(L, i)))
+				return (0);
+		} else
+			return luaL_argerror(L, i, "expected string or integer");
+	}
+
+	json_r_value(&r, 0);
+
+	return (1);
+}
+
+static int
+lua_json_encode_l(lua_State *L)
+{
+	luaL_checkany(L, 1);
+	lua_json_encode(L, 1, NULL);
+
+	return (1);
+}
+
+static const luaL_Reg lua_json[] = {
+	{ "encode",		lua_json_encode_l },
+	{ "decode",		lua_json_decode },
+	{ "get",		lua_json_get },
+
+	{ NULL,			NULL }
+};
+
+int
+luaopen_json(lua_State *L)
+{
+	luaL_newlib(L, lua_json);
+
+	lua_pushlightuserdata(L, NULL);
+	lua_setfield(L, -2, "null");
+
+	return (1);
+}
@@ -0,0 +1,63 @@
+/* */
+
+/*
+ * Copyright (c) 2026 David Gwynne <david@gwynne.id.au>
+ *
+ * Permission to use, copy, modify, and distribute this software for any
+ * purpose with or without fee is hereby granted, provided that the above
+ * copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" AND THE AUTHOR DISCLAIMS ALL WARRANTIES
+ * WITH REGARD TO THIS SOFTWARE INCLUDING ALL IMPLIED WARRANTIES OF
+ * MERCHANTABILITY AND FITNESS. IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR
+ * ANY SPECIAL, DIRECT, INDIRECT, OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN AN
+ * ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING OUT OF
+ * OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef _LUA_JSON_H_
+#define _LUA_JSON_H_
+
+#define JSON_W_MAXDEPTH		32
+
+/*
+ * json_writer builds a JSON document into a caller supplied buffer.
+ * running out of space or nesting too deep is sticky and reported
+ * by json_w_finish(), so callers don't have to check each call.
+ */
+struct json_writer {
+	char		*jw_buf;
+	size_t		 jw_len;
+	size_t		 jw_off;
+	int		 jw_grow;	/* realloc jw_buf as needed */
+	int		 jw_error;
+
+	unsigned int	 jw_depth;
+	uint32_t	 jw_more;	/* a value is already at this depth */
+};
+
+void	json_w_init(struct json_writer *, char *, size_t);
+int	json_w_init_grow(struct json_writer *, size_t);
+void	json_w_free(struct json_writer *);
+int	json_w_finish(struct json_writer *, const char **, size_t *);
+
+void	json_w_object(struct json_writer *, const char *);
+void	json_w_array(struct json_writer *, const char *);
+void	json_w_end_object(struct json_writer *);
+void	json_w_end_array(struct json_writer *);
+
+void	json_w_string(struct json_writer *, const char *,
+	    const char *, size_t);
+void	json_w_str(struct json_writer *, const char *, const char *);
+void	json_w_int(struct json_writer *, const char *, long long);
+void	json_w_uint(struct json_writer *, const char *, unsigned long long);
+void	json_w_number(struct json_writer *, const char *, double);
+void	json_w_bool(struct json_writer *, const char *, int);
+void	json_w_null(struct json_writer *, const char *);
+
+int	luaopen_json(lua_State *);
+const char *
+	lua_json_encode(lua_State *, int, size_t *);
+
+#endif /* _LUA_JSON_H_ */
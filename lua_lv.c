@@ -62,23 +62,194 @@ struct lua_lv_constants {
 
 #define LUA_LV_OBJ_T		"lv_obj_t"
 #define LUA_LV_OBJ_STR		"'" LUA_LV_OBJ_T "'"
-static const char lua_lv_obj_type[] = LUA_LV_OBJ_T;
 
 static const char lua_lv_style_type[] = "lv_style_t";
 static const char lua_lv_font_type[] = "lv_font_t";
+static const char lua_lv_event_type[] = "lv_event_t";
+static const char lua_lv_obj_methods_type[] = "_lua_lv_obj_methods";
+static const char lua_lv_obj_class_type[] = "_lua_lv_obj_class";
 
 static const char lua_lv_state[] = "_lua_lv_state";
+static const char lua_lv_obj_map[] = "_lua_lv_obj_map";
 static const char lua_lv_btnmatrix_map[] = "_lua_lv_btnmatrix_map";
+static const char lua_lv_types_key[] = "_lua_lv_types";
 
 struct lua_lv_obj {
 	lv_obj_t		*lv_obj;
+	const lv_obj_class_t	*lv_class;	/* lv_obj's never changes */
 };
 
-#define LUA_LV_OBJ_REF_LOBJ		1
-#define LUA_LV_OBJ_REF_USER_DATA	2
-#define LUA_LV_OBJ_REF_EVENTS		3
-#define LUA_LV_OBJ_REF_GRID_COL_DSC	4
-#define LUA_LV_OBJ_REF_GRID_ROW_DSC	5
+/*
+ * there's one of these per lua state, and it's pointed at whichever
+ * lv_event_t is being handled so events don't create garbage.
+ */
+struct lua_lv_event {
+	lv_event_t		*lv_event;
+};
+
+/*
+ * luaL_checkudata looks the metatable up in the registry by name for
+ * every argument it checks. the metatable pointers are cached here
+ * by luaopen_lv instead, and the lua_State extra space points at it.
+ */
+struct lua_lv_types {
+	const void		*style;
+	const void		*font;
+	const void		*event;
+	const void		*btnmatrix_map;
+	const void		*obj;		/* shared by class metatables */
+
+	uint64_t		 skipped;	/* no-op updates */
+};
+
+static inline struct lua_lv_types *
+lua_lv_types(lua_State *L)
+{
+	return (*(struct lua_lv_types **)lua_getextraspace(L));
+}
+
+/*
+ * mqtt messages and telemetry refreshes often repeat what a widget
+ * already shows, but lvgl setters like lv_label_set_text invalidate,
+ * relayout and redraw regardless. the setters here compare with the
+ * current value first and count the updates they were able to skip.
+ */
+static inline void
+lua_lv_skip(lua_State *L)
+{
+	lua_lv_types(L)->skipped++;
+}
+
+uint64_t
+lua_lv_skipped(lua_State *L)
+{
+	return (lua_lv_types(L)->skipped);
+}
+
+void
+lua_lv_skipped_reset(lua_State *L)
+{
+	lua_lv_types(L)->skipped = 0;
+}
+
+static int
+lua_lv_text_unchanged(const char *ostr, const char *str, size_t len)
+{
+	return (ostr != NULL && strlen(ostr) == len &&
+	    memcmp(ostr, str, len) == 0);
+}
+
+static void *
+lua_lv_testudata(lua_State *L, int idx, const void *mt)
+{
+	void *p = lua_touserdata(L, idx);
+	const void *umt;
+
+	if (p == NULL || !lua_getmetatable(L, idx))
+		return (NULL);
+
+	umt = lua_topointer(L, -1);
+	lua_pop(L, 1);
+
+	return (umt == mt ? p : NULL);
+}
+
+static void *
+lua_lv_checkudata(lua_State *L, int idx, const void *mt, const char *tname)
+{
+	void *p = lua_lv_testudata(L, idx, mt);
+	if (p == NULL) {
+		luaL_argerror(L, idx,
+		    lua_pushfstring(L, "'%s' expected", tname));
+	}
+	return (p);
+}
+
+/*
+ * each lvgl class gets its own metatable for lv_obj_t userdata, and
+ * they all share one metatable of their own to mark them as ours.
+ */
+static struct lua_lv_obj *
+lua_lv_obj_checkudata(lua_State *L, int idx)
+{
+	struct lua_lv_obj *lobj = lua_touserdata(L, idx);
+	const void *mark = NULL;
+
+	if (lobj != NULL && lua_getmetatable(L, idx)) {
+		if (lua_getmetatable(L, -1)) {
+			mark = lua_topointer(L, -1);
+			lua_pop(L, 1);
+		}
+		lua_pop(L, 1);
+
+		if (mark == lua_lv_types(L)->obj)
+			return (lobj);
+	}
+
+	luaL_argerror(L, idx, LUA_LV_OBJ_STR " expected");
+	return (NULL);
+}
+
+/*
+ * lv_obj_t userdata are found via a map keyed by the lv_obj_t
+ * pointer. the map holds a strong reference, so the userdata and
+ * the lvgl object it wraps last until the lvgl object is deleted.
+ *
+ * most objects never need anything else, so the references to other
+ * lua values that go with an object are kept in a table that is only
+ * created and set as the userdata's user value when one is stored.
+ */
+#define LUA_LV_OBJ_REF_USER_DATA	1
+#define LUA_LV_OBJ_REF_EVENTS		2
+#define LUA_LV_OBJ_REF_GRID_COL_DSC	3
+#define LUA_LV_OBJ_REF_GRID_ROW_DSC	4
+#define LUA_LV_OBJ_REF_STYLES		5	/* shared styles */
+#define LUA_LV_OBJ_REF_MAX		5
+
+/* push the userdata for obj, or nil if lua hasn't seen it */
+static int
+lua_lv_obj_map_get(lua_State *L, lv_obj_t *obj)
+{
+	int type;
+
+	lua_rawgetp(L, LUA_REGISTRYINDEX, lua_lv_obj_map);
+	type = lua_rawgetp(L, -1, obj);
+	lua_remove(L, -2);
+
+	return (type);
+}
+
+/* map obj to the value at the top of the stack, and pop it */
+static void
+lua_lv_obj_map_set(lua_State *L, lv_obj_t *obj)
+{
+	lua_rawgetp(L, LUA_REGISTRYINDEX, lua_lv_obj_map);
+	lua_insert(L, -2);
+	lua_rawsetp(L, -2, obj);
+	lua_pop(L, 1);
+}
+
+/* push the reference table for the userdata at idx */
+static int
+lua_lv_obj_refs(lua_State *L, int idx, int create)
+{
+	if (lua_getuservalue(L, idx) == LUA_TTABLE || !create)
+		return (lua_type(L, -1));
+
+	lua_pop(L, 1);
+
+	idx = lua_absindex(L, idx);
+	lua_createtable(L, LUA_LV_OBJ_REF_MAX, 0);
+	lua_pushvalue(L, -1);
+	lua_setuservalue(L, idx);
+
+	return (LUA_TTABLE);
+}
+
+/* the table for each event code in LUA_LV_OBJ_REF_EVENTS */
+#define LUA_LV_EVENT_REF_FN		1
+#define LUA_LV_EVENT_REF_ARG		2
+#define LUA_LV_EVENT_REF_DSC		3	/* lvgl's registration */
 
 static void
 lua_lv_obj_delete_cb(lv_event_t *e)
@@ -86,30 +257,33 @@ lua_lv_obj_delete_cb(lv_event_t *e)
 	lua_State *L = lv_event_get_user_data(e);
 	lv_obj_t *obj = lv_event_get_current_target(e);
 	struct lua_lv_obj *lobj;
-	unsigned int i;
 
-	if (lua_rawgetp(L, LUA_REGISTRYINDEX, obj) != LUA_TTABLE) {
-		LVDPRINTF("obj:%p, lua table is missing", obj);
+	if (lua_lv_obj_map_get(L, obj) != LUA_TUSERDATA) {
+		LVDPRINTF("obj:%p, lua udata is missing", obj);
+		lua_pop(L, 1);
 		return;
 	}
 
-	lua_rawgeti(L, -1, LUA_LV_OBJ_REF_LOBJ);
-	lobj = luaL_checkudata(L, -1, lua_lv_obj_type);
+	lobj = lua_lv_obj_checkudata(L, -1);
 
 	LVDPRINTF("obj:%p, lobj:%p, lobj->lv_obj:%p",
 	    obj, lobj, lobj->lv_obj);
 
 	lobj->lv_obj = NULL;
-	lua_pop(L, 2);
 
+	/* let go of the data and handlers */
 	lua_pushnil(L);
-	lua_rawsetp(L, LUA_REGISTRYINDEX, obj);
+	lua_setuservalue(L, -2);
+	lua_pop(L, 1);
+
+	lua_pushnil(L);
+	lua_lv_obj_map_set(L, obj);
 }
 
 static lv_obj_t *
 lua_lv_check_obj(lua_State *L, int idx)
 {
-	struct lua_lv_obj *lobj = luaL_checkudata(L, idx, lua_lv_obj_type);
+	struct lua_lv_obj *lobj = lua_lv_obj_checkudata(L, idx);
 	lv_obj_t *obj = lobj->lv_obj;
 	luaL_argcheck(L, obj != NULL, idx, LUA_LV_OBJ_STR " has been deleted");
 	return (obj);
@@ -118,29 +292,48 @@ lua_lv_check_obj(lua_State *L, int idx)
 static lv_obj_t *
 lua_lv_check_obj_class(lua_State *L, int idx, const lv_obj_class_t *class)
 {
-	lv_obj_t *obj = lua_lv_check_obj(L, idx);
-	if (obj != NULL) {
-		luaL_argcheck(L, lv_obj_has_class(obj, class), idx,
-		    LUA_LV_OBJ_STR " wrong class");
-	}
+	struct lua_lv_obj *lobj = lua_lv_obj_checkudata(L, idx);
+	lv_obj_t *obj = lobj->lv_obj;
+	luaL_argcheck(L, obj != NULL, idx, LUA_LV_OBJ_STR " has been deleted");
+	luaL_argcheck(L, lobj->lv_class == class, idx,
+	    LUA_LV_OBJ_STR " wrong class");
 	return (obj);
 }
 
+/* for wslv to get at objects passed to it from lua */
+lv_obj_t *
+lua_lv_checkobj(lua_State *L, int idx, const lv_obj_class_t *class)
+{
+	if (class == NULL)
+		return (lua_lv_check_obj(L, idx));
+
+	return (lua_lv_check_obj_class(L, idx, class));
+}
+
 static struct lua_lv_obj *
 lua_lv_obj_register(lua_State *L, lv_obj_t *obj)
 {
 	struct lua_lv_obj *lobj;
+	const lv_obj_class_t *c;
 
 	lobj = lua_newuserdata(L, sizeof(*lobj));
 	lobj->lv_obj = obj;
+	lobj->lv_class = lv_obj_get_class(obj);
 
 	lv_obj_add_event_cb(obj, lua_lv_obj_delete_cb, LV_EVENT_DELETE, L);
-	luaL_setmetatable(L, lua_lv_obj_type);
 
-	lua_newtable(L); /* t = {} */
-	lua_pushvalue(L, -2);
-	lua_rawseti(L, -2, LUA_LV_OBJ_REF_LOBJ); /* t[1] = lobj */
-	lua_rawsetp(L, LUA_REGISTRYINDEX, obj); /* lua[obj] = t */
+	/* use the metatable for the closest class lua knows about */
+	for (c = lv_obj_get_class(obj); c != NULL; c = c->base_class) {
+		if (lua_rawgetp(L, LUA_REGISTRYINDEX, c) == LUA_TTABLE)
+			break;
+		lua_pop(L, 1);
+	}
+	if (c == NULL)
+		luaL_error(L, "no metatable for lv obj class");
+	lua_setmetatable(L, -2);
+
+	lua_pushvalue(L, -1);
+	lua_lv_obj_map_set(L, obj); /* map[obj] = lobj */
 
 	return (lobj);
 }
@@ -150,14 +343,13 @@ lua_lv_obj_getp(lua_State *L, lv_obj_t *obj)
 {
 	struct lua_lv_obj *lobj;
 
-	switch (lua_rawgetp(L, LUA_REGISTRYINDEX, obj)) {
+	switch (lua_lv_obj_map_get(L, obj)) {
 	case LUA_TNIL:
+		lua_pop(L, 1);
 		lobj = lua_lv_obj_register(L, obj);
 		break;
-	case LUA_TTABLE:
-		lua_rawgeti(L, -1, LUA_LV_OBJ_REF_LOBJ);
-		lobj = luaL_checkudata(L, -1, lua_lv_obj_type);
-		lua_remove(L, -2);
+	case LUA_TUSERDATA:
+		lobj = lua_lv_obj_checkudata(L, -1);
 		if (lobj->lv_obj != obj) {
 			luaL_error(L, "lv_lv_obj_getp udata mismatch");
 			return (NULL);
@@ -273,27 +465,112 @@ lua_lv_switch_create(lua_State *L)
 	return (lua_lv_obj_create_udata(L, lv_switch_create));
 }
 
+static lv_event_t *
+lua_lv_check_event(lua_State *L, int idx)
+{
+	struct lua_lv_event *levent = lua_lv_checkudata(L, idx,
+	    lua_lv_types(L)->event, lua_lv_event_type);
+	lv_event_t *e = levent->lv_event;
+	luaL_argcheck(L, e != NULL, idx, "event handler has returned");
+	return (e);
+}
+
+static int
+lua_lv_event_point(lua_State *L)
+{
+	lv_indev_t *indev;
+	lv_point_t p;
+
+	lua_lv_check_event(L, 1);
+
+	indev = lv_indev_active();
+	if (indev == NULL)
+		return (0);
+
+	lv_indev_get_point(indev, &p);
+	lua_pushinteger(L, p.x);
+	lua_pushinteger(L, p.y);
+	return (2);
+}
+
+static int
+lua_lv_event_vect(lua_State *L)
+{
+	lv_indev_t *indev;
+	lv_point_t p;
+
+	lua_lv_check_event(L, 1);
+
+	indev = lv_indev_active();
+	if (indev == NULL)
+		return (0);
+
+	lv_indev_get_vect(indev, &p);
+	lua_pushinteger(L, p.x);
+	lua_pushinteger(L, p.y);
+	return (2);
+}
+
+static int
+lua_lv_event_key(lua_State *L)
+{
+	lv_event_t *e = lua_lv_check_event(L, 1);
+
+	lua_pushinteger(L, lv_event_get_key(e));
+	return (1);
+}
+
+/* everything is read from the live lv_event_t when it's asked for */
+static int
+lua_lv_event__index(lua_State *L)
+{
+	lv_event_t *e = lua_lv_check_event(L, 1);
+	const char *key = luaL_checkstring(L, 2);
+
+	if (strcmp(key, "code") == 0)
+		lua_pushinteger(L, lv_event_get_code(e));
+	else if (strcmp(key, "data") == 0)
+		lua_getuservalue(L, 1);
+	else if (strcmp(key, "target") == 0)
+		lua_lv_obj_getp(L, lv_event_get_target_obj(e));
+	else if (strcmp(key, "point") == 0)
+		lua_pushcfunction(L, lua_lv_event_point);
+	else if (strcmp(key, "vect") == 0)
+		lua_pushcfunction(L, lua_lv_event_vect);
+	else if (strcmp(key, "key") == 0)
+		lua_pushcfunction(L, lua_lv_event_key);
+	else
+		lua_pushnil(L);
+
+	return (1);
+}
+
 static void
-lua_lv_event_cb_pcall(lua_State *L, lv_event_t *e)
+lua_lv_event_cb_pcall(lua_State *L, int lidx, lv_event_t *e)
 {
-	lv_event_code_t event = lv_event_get_code(e);
+	struct lua_lv_event *levent;
+	lv_event_t *oe;
 
-	/* event table is at top, lobj at top - 2 */
+	/* event table is at top */
 	int top = lua_gettop(L);
 	int ret;
 
-	lua_rawgeti(L, top, 1); /* fn for pcall */
-	lua_pushvalue(L, top - 2);
-
-	lua_newtable(L); /* event data */
+	/*
+	 * handlers can cause other events to be handled, so save
+	 * what the event object pointed at to restore it afterwards.
+	 */
+	lua_rawgetp(L, LUA_REGISTRYINDEX, lua_lv_event_type);
+	levent = lua_touserdata(L, -1);
+	oe = levent->lv_event;
+	lua_getuservalue(L, -1); /* top + 2 */
 
-	lua_pushliteral(L, "code");
-	lua_pushinteger(L, event);
-	lua_rawset(L, -3);
+	lua_rawgeti(L, top, LUA_LV_EVENT_REF_FN); /* fn for pcall */
+	lua_pushvalue(L, lidx);
+	lua_pushvalue(L, top + 1);
 
-	lua_pushliteral(L, "data");
-	lua_rawgeti(L, top, 2); /* this might be nil */
-	lua_rawset(L, -3);
+	lua_rawgeti(L, top, LUA_LV_EVENT_REF_ARG); /* this might be nil */
+	lua_setuservalue(L, top + 1);
+	levent->lv_event = e;
 
 	ret = lua_pcall(L, 2, 0, 0);
 	switch (ret) {
@@ -313,35 +590,45 @@ lua_lv_event_cb_pcall(lua_State *L, lv_event_t *e)
 		break;
 	}
 
+	levent->lv_event = oe;
+	lua_pushvalue(L, top + 2);
+	lua_setuservalue(L, top + 1);
+
 	lua_settop(L, top);
 }
 
+/*
+ * lua_lv_event_cb is registered with lvgl once for each event code
+ * that lua has a handler for, so lvgl doesn't call into here for the
+ * draw, style and layout events nothing in lua cares about.
+ */
 static void
-lua_lv_event_cb(lv_event_t *e)
+lua_lv_event_dispatch(lv_event_t *e, lv_event_code_t event)
 {
 	lua_State *L = lv_event_get_user_data(e);
 	lv_obj_t *obj = lv_event_get_current_target(e);
-	lv_event_code_t event = lv_event_get_code(e);
 	struct lua_lv_obj *lobj;
-	int type;
 
 	int top = lua_gettop(L);
 
-	switch (lua_rawgetp(L, LUA_REGISTRYINDEX, obj)) {
+	switch (lua_lv_obj_map_get(L, obj)) {
 	case LUA_TNIL:
-		LVDPRINTF("obj:%p, lua table is missing", obj);
+		LVDPRINTF("obj:%p, lua udata is missing", obj);
 		goto pop;
-	case LUA_TTABLE:
+	case LUA_TUSERDATA:
 		break;
 	default:
-		LVDPRINTF("obj:%p, weird type in lua registry", obj);
+		LVDPRINTF("obj:%p, weird type in lua obj map", obj);
 		goto pop;
 	}
 
-	lua_rawgeti(L, -1, LUA_LV_OBJ_REF_LOBJ);
-	lobj = luaL_checkudata(L, -1, lua_lv_obj_type);
+	lobj = lua_lv_obj_checkudata(L, top + 1);
+	if (lua_lv_obj_refs(L, top + 1, 0) != LUA_TTABLE) {
+		LVDPRINTF("obj:%p, lobj:%p, no refs", obj, lobj);
+		goto pop;
+	}
 
-	switch (lua_rawgeti(L, -2, LUA_LV_OBJ_REF_EVENTS)) {
+	switch (lua_rawgeti(L, -1, LUA_LV_OBJ_REF_EVENTS)) {
 	case LUA_TNIL:
 		LVDPRINTF("obj:%p, no event table", obj);
 		goto pop;
@@ -354,57 +641,95 @@ lua_lv_event_cb(lv_event_t *e)
 
 	lua_rawgeti(L, -1, event);
 	if (lua_istable(L, -1))
-		lua_lv_event_cb_pcall(L, e);
-	lua_pop(L, 1);
-
-	lua_rawgeti(L, -1, LV_EVENT_ALL);
-	if (lua_istable(L, -1))
-		lua_lv_event_cb_pcall(L, e);
+		lua_lv_event_cb_pcall(L, top + 1, e);
 	/* lua_pop(L, 1); - going to pop anyway */
 
 pop:
 	lua_settop(L, top);
 }
 
-static int
-lua_lv_obj_add_event_cb(lua_State *L)
+static void
+lua_lv_event_cb(lv_event_t *e)
 {
-	lv_obj_t *obj = lua_lv_check_obj(L, 1);
-	lv_event_code_t event = luaL_checkinteger(L, 2);
-	int type;
-	int add = 0;
+	lua_lv_event_dispatch(e, lv_event_get_code(e));
+}
 
-	luaL_argcheck(L, lua_isfunction(L, 3), 3, "callback function required");
+static void
+lua_lv_event_all_cb(lv_event_t *e)
+{
+	lua_lv_event_dispatch(e, LV_EVENT_ALL);
+}
+
+/*
+ * make the function at fidx the handler for event on the obj at oidx.
+ * aidx is where the handler's data argument is, or 0 if it has none.
+ */
+static void
+lua_lv_obj_event_add(lua_State *L, int oidx, lv_event_code_t event,
+    int fidx, int aidx)
+{
+	struct lua_lv_obj *lobj = lua_touserdata(L, oidx);
+	lv_event_dsc_t *dsc = NULL;
+	int top = lua_gettop(L);
+	int events;
 
-	type = lua_rawgetp(L, LUA_REGISTRYINDEX, obj);
-	luaL_argcheck(L, type == LUA_TTABLE, 1, "lv obj has no table");
+	lua_lv_obj_refs(L, oidx, 1);
 
 	if (lua_rawgeti(L, -1, LUA_LV_OBJ_REF_EVENTS) == LUA_TNIL) {
 		lua_pop(L, 1);
 
 		lua_newtable(L);
-		add = 1;
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, -3, LUA_LV_OBJ_REF_EVENTS);
 	}
+	events = lua_gettop(L);
 
-	lua_pushinteger(L, event);
+	/* replacing a handler can keep the existing lvgl registration */
+	if (lua_rawgeti(L, events, event) == LUA_TTABLE) {
+		lua_rawgeti(L, -1, LUA_LV_EVENT_REF_DSC);
+		dsc = lua_touserdata(L, -1);
+		lua_pop(L, 1);
+	}
+	lua_pop(L, 1);
 
-	/* { fn, arg } */
-	lua_newtable(L);
+	if (dsc == NULL) {
+		dsc = lv_obj_add_event_cb(lobj->lv_obj, event == LV_EVENT_ALL ?
+		    lua_lv_event_all_cb : lua_lv_event_cb, event, L);
+		if (dsc == NULL)
+			luaL_error(L, "unable to add event callback");
+	}
 
-	lua_pushvalue(L, 3);
-	lua_rawseti(L, -2, 1);
+	/* { fn, arg, dsc } */
+	lua_createtable(L, 3, 0);
 
-	if (!lua_isnoneornil(L, 4)) {
-		lua_pushvalue(L, 4);
-		lua_rawseti(L, -2, 2);
+	lua_pushvalue(L, fidx);
+	lua_rawseti(L, -2, LUA_LV_EVENT_REF_FN);
+
+	if (aidx != 0) {
+		lua_pushvalue(L, aidx);
+		lua_rawseti(L, -2, LUA_LV_EVENT_REF_ARG);
 	}
 
-	lua_rawset(L, -3);
+	lua_pushlightuserdata(L, dsc);
+	lua_rawseti(L, -2, LUA_LV_EVENT_REF_DSC);
 
-	if (add) {
-		lua_rawseti(L, -2, LUA_LV_OBJ_REF_EVENTS);
-		lv_obj_add_event_cb(obj, lua_lv_event_cb, LV_EVENT_ALL, L);
-	}
+	lua_rawseti(L, events, event);
+
+	lua_settop(L, top);
+}
+
+static int
+lua_lv_obj_add_event_cb(lua_State *L)
+{
+	lv_event_code_t event;
+
+	lua_lv_check_obj(L, 1);
+	event = luaL_checkinteger(L, 2);
+
+	luaL_argcheck(L, lua_isfunction(L, 3), 3, "callback function required");
+	lua_settop(L, 4);
+
+	lua_lv_obj_event_add(L, 1, event, 3, 4);
 
 	return (0);
 }
@@ -414,26 +739,37 @@ lua_lv_obj_del_event_cb(lua_State *L)
 {
 	lv_obj_t *obj = lua_lv_check_obj(L, 1);
 	lv_event_code_t event = luaL_checkinteger(L, 2);
-	int type;
+	lv_event_dsc_t *dsc;
 
-	type = lua_rawgetp(L, LUA_REGISTRYINDEX, obj);
-	luaL_argcheck(L, type == LUA_TTABLE, 1, "lv obj has no table");
+	lua_settop(L, 2);
 
-	if (lua_rawgeti(L, -1, LUA_LV_OBJ_REF_EVENTS) == LUA_TNIL) {
-		LVDPRINTF("obj:%p, event %d found", obj, event);
+	if (lua_lv_obj_refs(L, 1, 0) != LUA_TTABLE) /* 3 */
+		return (0);
+
+	if (lua_rawgeti(L, 3, LUA_LV_OBJ_REF_EVENTS) != LUA_TTABLE) { /* 4 */
+		LVDPRINTF("obj:%p, no event table", obj);
+		return (0);
+	}
+
+	if (lua_rawgeti(L, 4, event) != LUA_TTABLE) { /* 5 */
+		LVDPRINTF("obj:%p, event %d not found", obj, event);
 		return (0);
 	}
 
+	lua_rawgeti(L, 5, LUA_LV_EVENT_REF_DSC);
+	dsc = lua_touserdata(L, -1);
+	if (dsc != NULL)
+		lv_obj_remove_event_dsc(obj, dsc);
+
 	lua_pushnil(L);
-	lua_rawseti(L, -2, LUA_LV_OBJ_REF_EVENTS);
+	lua_rawseti(L, 4, event);
 
 	lua_pushnil(L);
-	if (!lua_next(L, -2)) {
+	if (!lua_next(L, 4)) {
 		LVDPRINTF("obj:%p, empty event table", obj);
-		lv_obj_remove_event_cb_with_user_data(obj, lua_lv_event_cb, L);
 
 		lua_pushnil(L);
-		lua_rawseti(L, -3, LUA_LV_OBJ_REF_EVENTS);
+		lua_rawseti(L, 3, LUA_LV_OBJ_REF_EVENTS);
 	}
 
 	return (0);
@@ -442,7 +778,7 @@ lua_lv_obj_del_event_cb(lua_State *L)
 static int
 lua_lv_obj__gc(lua_State *L)
 {
-	struct lua_lv_obj *lobj = luaL_checkudata(L, 1, lua_lv_obj_type);
+	struct lua_lv_obj *lobj = lua_lv_obj_checkudata(L, 1);
 	lv_obj_t *obj = lobj->lv_obj;
 
 	LVDPRINTF("obj:%p, lobj:%p", obj, lobj);
@@ -469,43 +805,31 @@ lua_lv_obj__gc(lua_State *L)
 	return (0);
 }
 
+/*
+ * __index for objects is the flattened method table for the class,
+ * so a method lookup never leaves the vm. this only runs on a miss,
+ * and only gets the method table, not the object, so obj.data can't
+ * be answered here and obj:get_data() reads it instead.
+ */
 static int
-lua_lv_obj__index(lua_State *L)
+lua_lv_obj_methods__index(lua_State *L)
 {
-	struct lua_lv_obj *lobj = luaL_checkudata(L, 1, lua_lv_obj_type);
-	lv_obj_t *obj = lobj->lv_obj;
 	const char *key = lua_tostring(L, 2);
 
-	if (strcmp(key, "data") == 0) {
-		int type = lua_rawgetp(L, LUA_REGISTRYINDEX, obj);
-		luaL_argcheck(L, type == LUA_TTABLE, 1, "lv obj has no table");
-
-		lua_rawgeti(L, -1, LUA_LV_OBJ_REF_USER_DATA);
-		lua_remove(L, -2);
-
-		return (1);
-	}
-
-	if (obj != NULL) {
-		const lv_obj_class_t *c;
-		for (c = lv_obj_get_class(obj); c != NULL; c = c->base_class) {
-			lua_rawgetp(L, LUA_REGISTRYINDEX, c);
-			if (!lua_istable(L, -1)) {
-				lua_pop(L, 1);
-				continue;
-			}
+	if (key != NULL && strcmp(key, "data") == 0)
+		return luaL_error(L, "use obj:get_data() to read data");
 
-			lua_pushstring(L, key);
-			lua_rawget(L, -2);
-			if (lua_isfunction(L, -1))
-				return (1);
-		}
-	}
+	lua_pushnil(L);
+	return (1);
+}
 
-	if (lua_getmetatable(L, -2)) {
-		lua_pushstring(L, key);
-		lua_rawget(L, -2);
-	} else
+static int
+lua_lv_obj_get_data(lua_State *L)
+{
+	lua_lv_obj_checkudata(L, 1);
+	if (lua_lv_obj_refs(L, 1, 0) == LUA_TTABLE)
+		lua_rawgeti(L, -1, LUA_LV_OBJ_REF_USER_DATA);
+	else
 		lua_pushnil(L);
 
 	return (1);
@@ -514,13 +838,14 @@ lua_lv_obj__index(lua_State *L)
 static int
 lua_lv_obj__newindex(lua_State *L)
 {
-	struct lua_lv_obj *lobj = luaL_checkudata(L, 1, lua_lv_obj_type);
+	struct lua_lv_obj *lobj = lua_lv_obj_checkudata(L, 1);
 	lv_obj_t *obj = lobj->lv_obj;
 	const char *key = lua_tostring(L, 2);
 
 	if (strcmp(key, "data") == 0) {
-		int type = lua_rawgetp(L, LUA_REGISTRYINDEX, obj);
-		luaL_argcheck(L, type == LUA_TTABLE, 1, "lv obj has no table");
+		luaL_argcheck(L, obj != NULL, 1,
+		    LUA_LV_OBJ_STR " has been deleted");
+		lua_lv_obj_refs(L, 1, 1);
 
 		lua_pushvalue(L, 3);
 		lua_rawseti(L, -2, LUA_LV_OBJ_REF_USER_DATA);
@@ -853,13 +1178,11 @@ lua_lv_obj_set_grid_array(lua_State *L)
 	lv_obj_t *obj = lua_lv_check_obj(L, 1);
 	lv_coord_t *col_dsc;
 	lv_coord_t *row_dsc;
-	int type;
 
 	if (lua_gettop(L) != 3)
 		return luaL_error(L, "invalid number of arguments");
 
-	type = lua_rawgetp(L, LUA_REGISTRYINDEX, obj);
-	luaL_argcheck(L, type == LUA_TTABLE, 1, "lv obj has no table");
+	lua_lv_obj_refs(L, 1, 1);
 
 	col_dsc = lua_lv_obj_set_grid_array_dsc(L, 2);
 	lua_rawseti(L, -2, LUA_LV_OBJ_REF_GRID_COL_DSC);
@@ -927,6 +1250,23 @@ lua_lv_obj_set_grid_align(lua_State *L)
 	return (0);
 }
 
+static void
+lua_lv_obj_update_state(lua_State *L, lv_obj_t *obj, lv_state_t state,
+    int set)
+{
+	lv_state_t ostate = lv_obj_get_state(obj);
+
+	if ((set ? (ostate | state) : (ostate & ~state)) == ostate) {
+		lua_lv_skip(L);
+		return;
+	}
+
+	if (set)
+		lv_obj_add_state(obj, state);
+	else
+		lv_obj_clear_state(obj, state);
+}
+
 static int
 lua_lv_obj_state(lua_State *L)
 {
@@ -937,10 +1277,7 @@ lua_lv_obj_state(lua_State *L)
 	switch (lua_gettop(L)) {
 	case 3:
 		set = lua_toboolean(L, 3);
-		if (set)
-			lv_obj_add_state(obj, state);
-		else
-			lv_obj_clear_state(obj, state);
+		lua_lv_obj_update_state(L, obj, state, set);
 		break;
 	case 2:
 		set = lv_obj_has_state(obj, state);
@@ -997,10 +1334,7 @@ lua_lv_obj_state_bit(lua_State *L, lv_state_t state)
 	switch (lua_gettop(L)) {
 	case 2:
 		set = lua_toboolean(L, 2);
-		if (set)
-			lv_obj_add_state(obj, state);
-		else
-			lv_obj_clear_state(obj, state);
+		lua_lv_obj_update_state(L, obj, state, set);
 		break;
 	case 1:
 		set = lv_obj_has_state(obj, state);
@@ -1035,10 +1369,7 @@ lua_lv_obj_enabled(lua_State *L)
 	switch (lua_gettop(L)) {
 	case 2:
 		set = lua_toboolean(L, 2);
-		if (set)
-			lv_obj_clear_state(obj, state);
-		else
-			lv_obj_add_state(obj, state);
+		lua_lv_obj_update_state(L, obj, state, !set);
 		break;
 	case 1:
 		set = !lv_obj_has_state(obj, state);
@@ -1334,7 +1665,8 @@ lua_lv_font_create(lua_State *L)
 static int
 lua_lv_font__index(lua_State *L)
 {
-	struct lua_lv_font *lf = luaL_checkudata(L, 1, lua_lv_font_type);
+	struct lua_lv_font *lf = lua_lv_checkudata(L, 1,
+	    lua_lv_types(L)->font, lua_lv_font_type);
 	const char *key = lua_tostring(L, 2);
 
 	if (lua_getmetatable(L, -2)) {
@@ -1349,7 +1681,8 @@ lua_lv_font__index(lua_State *L)
 static int
 lua_lv_font__newindex(lua_State *L)
 {
-	struct lua_lv_font *lf = luaL_checkudata(L, 1, lua_lv_font_type);
+	struct lua_lv_font *lf = lua_lv_checkudata(L, 1,
+	    lua_lv_types(L)->font, lua_lv_font_type);
 	LVDPRINTF("lf:%p, gettop():%d", lf, lua_gettop(L));
 	return (0);
 }
@@ -1357,7 +1690,8 @@ lua_lv_font__newindex(lua_State *L)
 static int
 lua_lv_font__gc(lua_State *L)
 {
-	struct lua_lv_font *lf = luaL_checkudata(L, 1, lua_lv_font_type);
+	struct lua_lv_font *lf = lua_lv_checkudata(L, 1,
+	    lua_lv_types(L)->font, lua_lv_font_type);
 
 	if (lf->font != NULL)
 		lv_freetype_font_delete(lf->font);
@@ -1509,7 +1843,7 @@ lua_lv_style_font(lua_State *L, int idx)
 	lv_style_value_t v;
 	lv_font_t *f;
 
-	if (luaL_testudata(L, idx, lua_lv_font_type)) {
+	if (lua_lv_testudata(L, idx, lua_lv_types(L)->font) != NULL) {
 		struct lua_lv_font *lf = lua_touserdata(L, idx);
 		f = lf->font;
 	} else {
@@ -1527,6 +1861,31 @@ lua_lv_style_font(lua_State *L, int idx)
 	return (v);
 }
 
+/* only compare the union member the prop actually uses */
+static uint64_t
+lua_lv_style_value_key(const struct lua_lv_style *s, lv_style_value_t v)
+{
+	if (s->check == lua_lv_style_color)
+		return (lv_color_to_int(v.color));
+	if (s->check == lua_lv_style_font)
+		return ((uintptr_t)v.ptr);
+
+	return ((uint32_t)v.num);
+}
+
+static int
+lua_lv_obj_style_unchanged(lv_obj_t *obj, const struct lua_lv_style *s,
+    lv_style_value_t v, lv_style_selector_t selector)
+{
+	lv_style_value_t ov;
+
+	if (lv_obj_get_local_style_prop(obj, s->prop, &ov, selector) !=
+	    LV_STYLE_RES_FOUND)
+		return (0);
+
+	return (lua_lv_style_value_key(s, ov) == lua_lv_style_value_key(s, v));
+}
+
 static const struct lua_lv_style lua_lv_styles[] = {
 	{ "width",		LV_STYLE_WIDTH,		lua_lv_style_num },
 	{ "w",			LV_STYLE_WIDTH,		lua_lv_style_num },
@@ -1737,7 +2096,8 @@ lua_lv_style_create(lua_State *L)
 static int
 lua_lv_style__index(lua_State *L)
 {
-	lv_style_t *style = luaL_checkudata(L, 1, lua_lv_style_type);
+	lv_style_t *style = lua_lv_checkudata(L, 1,
+	    lua_lv_types(L)->style, lua_lv_style_type);
 	const char *key = lua_tostring(L, 2);
 
 	if (lua_getmetatable(L, -2)) {
@@ -1752,7 +2112,8 @@ lua_lv_style__index(lua_State *L)
 static int
 lua_lv_style__newindex(lua_State *L)
 {
-	lv_style_t *style = luaL_checkudata(L, 1, lua_lv_style_type);
+	lv_style_t *style = lua_lv_checkudata(L, 1,
+	    lua_lv_types(L)->style, lua_lv_style_type);
 	LVDPRINTF("style:%p, gettop():%d", style, lua_gettop(L));
 	return (0);
 }
@@ -1760,7 +2121,8 @@ lua_lv_style__newindex(lua_State *L)
 static int
 lua_lv_style__gc(lua_State *L)
 {
-	lv_style_t *style = luaL_checkudata(L, 1, lua_lv_style_type);
+	lv_style_t *style = lua_lv_checkudata(L, 1,
+	    lua_lv_types(L)->style, lua_lv_style_type);
 	LVDPRINTF("style:%p", style);
 	lv_style_reset(style);
 	return (0);
@@ -1799,7 +2161,8 @@ lua_lv_style_set_table(lua_State *L, lv_style_t *style, int idx)
 static int
 lua_lv_style_set(lua_State *L)
 {
-	lv_style_t *style = luaL_checkudata(L, 1, lua_lv_style_type);
+	lv_style_t *style = lua_lv_checkudata(L, 1,
+	    lua_lv_types(L)->style, lua_lv_style_type);
 	const struct lua_lv_style *s;
 	lv_style_value_t v;
 
@@ -1829,7 +2192,8 @@ lua_lv_style_set(lua_State *L)
 static int
 lua_lv_style_remove(lua_State *L)
 {
-	lv_style_t *style = luaL_checkudata(L, 1, lua_lv_style_type);
+	lv_style_t *style = lua_lv_checkudata(L, 1,
+	    lua_lv_types(L)->style, lua_lv_style_type);
 	const struct lua_lv_style *s;
 	lv_style_value_t v;
 
@@ -1848,7 +2212,8 @@ lua_lv_style_remove(lua_State *L)
 static int
 lua_lv_style_reset(lua_State *L)
 {
-	lv_style_t *style = luaL_checkudata(L, 1, lua_lv_style_type);
+	lv_style_t *style = lua_lv_checkudata(L, 1,
+	    lua_lv_types(L)->style, lua_lv_style_type);
 	lv_style_reset(style);
 	return (0);
 }
@@ -1880,7 +2245,10 @@ lua_lv_obj_set_style(lua_State *L)
 
 	v = s->check(L, 3);
 
-	lv_obj_set_local_style_prop(obj, s->prop, v, selector);
+	if (lua_lv_obj_style_unchanged(obj, s, v, selector))
+		lua_lv_skip(L);
+	else
+		lv_obj_set_local_style_prop(obj, s->prop, v, selector);
 
 	return (0);
 }
@@ -1889,7 +2257,8 @@ static int
 lua_lv_obj_add_style(lua_State *L)
 {
 	lv_obj_t *obj = lua_lv_check_obj(L, 1);
-	lv_style_t *style = luaL_checkudata(L, 2, lua_lv_style_type);
+	lv_style_t *style = lua_lv_checkudata(L, 2,
+	    lua_lv_types(L)->style, lua_lv_style_type);
 	int selector = LV_PART_MAIN;
 
 	switch (lua_gettop(L)) {
@@ -1908,16 +2277,521 @@ lua_lv_obj_add_style(lua_State *L)
 }
 
 /*
- * lua_lv_obj metatable methods
+ * obj:set{ ... } applies a table of properties in one call. the
+ * keys are all checked first, then the properties are applied in
+ * the order of lua_lv_obj_setter_list rather than the table's, so
+ * eg, align always wins over pos no matter how lua hashed them.
  */
 
-static const luaL_Reg lua_lv_obj_methods[] = {
-	{ "center",		lua_lv_obj_center },
-	{ "del",		lua_lv_obj_del },
-	{ "del_async",		lua_lv_obj_del_async },
-	{ "remove_style_all",	lua_lv_obj_remove_style_all },
-	{ "invalidate",		lua_lv_obj_invalidate },
-
+struct lua_lv_obj_setter {
+	const char		*name;
+	void (*set)(lua_State *, struct lua_lv_obj *, int);
+};
+
+static const char lua_lv_obj_setters[] = "_lua_lv_obj_setters";
+
+/* how many style props are checked before they are applied together */
+#define LUA_LV_OBJ_SET_STYLES	32
+
+static lv_coord_t
+lua_lv_obj_set_field(lua_State *L, int idx, int i)
+{
+	lv_coord_t v;
+
+	lua_rawgeti(L, idx, i);
+	v = luaL_checkinteger(L, -1);
+	lua_pop(L, 1);
+
+	return (v);
+}
+
+static void
+lua_lv_obj_set_x(lua_State *L, struct lua_lv_obj *lobj, int idx)
+{
+	lv_obj_set_x(lobj->lv_obj, luaL_checkinteger(L, idx));
+}
+
+static void
+lua_lv_obj_set_y(lua_State *L, struct lua_lv_obj *lobj, int idx)
+{
+	lv_obj_set_y(lobj->lv_obj, luaL_checkinteger(L, idx));
+}
+
+static void
+lua_lv_obj_set_pos(lua_State *L, struct lua_lv_obj *lobj, int idx)
+{
+	luaL_checktype(L, idx, LUA_TTABLE);
+	lv_obj_set_pos(lobj->lv_obj,
+	    lua_lv_obj_set_field(L, idx, 1), lua_lv_obj_set_field(L, idx, 2));
+}
+
+static void
+lua_lv_obj_set_width(lua_State *L, struct lua_lv_obj *lobj, int idx)
+{
+	lv_obj_set_width(lobj->lv_obj, luaL_checkinteger(L, idx));
+}
+
+static void
+lua_lv_obj_set_height(lua_State *L, struct lua_lv_obj *lobj, int idx)
+{
+	lv_obj_set_height(lobj->lv_obj, luaL_checkinteger(L, idx));
+}
+
+static void
+lua_lv_obj_set_size(lua_State *L, struct lua_lv_obj *lobj, int idx)
+{
+	luaL_checktype(L, idx, LUA_TTABLE);
+	lv_obj_set_size(lobj->lv_obj,
+	    lua_lv_obj_set_field(L, idx, 1), lua_lv_obj_set_field(L, idx, 2));
+}
+
+/* align = lv.ALIGN.X, or align = { lv.ALIGN.X, x, y } */
+static void
+lua_lv_obj_set_align(lua_State *L, struct lua_lv_obj *lobj, int idx)
+{
+	lv_align_t align;
+	lv_coord_t x = 0, y = 0;
+
+	if (lua_istable(L, idx)) {
+		align = lua_lv_obj_set_field(L, idx, 1);
+		if (lua_rawlen(L, idx) >= 3) {
+			x = lua_lv_obj_set_field(L, idx, 2);
+			y = lua_lv_obj_set_field(L, idx, 3);
+		}
+	} else
+		align = luaL_checkinteger(L, idx);
+
+	lv_obj_align(lobj->lv_obj, align, x, y);
+}
+
+static void
+lua_lv_obj_set_center(lua_State *L, struct lua_lv_obj *lobj, int idx)
+{
+	if (lua_toboolean(L, idx))
+		lv_obj_center(lobj->lv_obj);
+}
+
+/* flags = { [lv.OBJ_FLAG.X] = true, [lv.OBJ_FLAG.Y] = false } */
+static void
+lua_lv_obj_set_flags(lua_State *L, struct lua_lv_obj *lobj, int idx)
+{
+	lv_obj_flag_t flag;
+
+	luaL_checktype(L, idx, LUA_TTABLE);
+
+	lua_pushnil(L);
+	while (lua_next(L, idx)) {
+		flag = luaL_checkinteger(L, -2);
+		if (lua_toboolean(L, -1))
+			lv_obj_add_flag(lobj->lv_obj, flag);
+		else
+			lv_obj_clear_flag(lobj->lv_obj, flag);
+		lua_pop(L, 1);
+	}
+}
+
+/* states = { [lv.STATE.CHECKED] = true } */
+static void
+lua_lv_obj_set_states(lua_State *L, struct lua_lv_obj *lobj, int idx)
+{
+	lv_state_t state;
+
+	luaL_checktype(L, idx, LUA_TTABLE);
+
+	lua_pushnil(L);
+	while (lua_next(L, idx)) {
+		state = luaL_checkinteger(L, -2);
+		lua_lv_obj_update_state(L, lobj->lv_obj, state,
+		    lua_toboolean(L, -1));
+		lua_pop(L, 1);
+	}
+}
+
+static void
+lua_lv_obj_set_text(lua_State *L, struct lua_lv_obj *lobj, int idx)
+{
+	size_t len;
+	const char *str = luaL_checklstring(L, idx, &len);
+	const char *ostr = NULL;
+
+	if (lobj->lv_class == &lv_label_class)
+		ostr = lv_label_get_text(lobj->lv_obj);
+	else if (lobj->lv_class == &lv_checkbox_class)
+		ostr = lv_checkbox_get_text(lobj->lv_obj);
+	else
+		luaL_error(L, "text is not supported by this object");
+
+	if (lua_lv_text_unchanged(ostr, str, len)) {
+		lua_lv_skip(L);
+		return;
+	}
+
+	if (lobj->lv_class == &lv_label_class)
+		lv_label_set_text(lobj->lv_obj, str);
+	else
+		lv_checkbox_set_text(lobj->lv_obj, str);
+}
+
+static void
+lua_lv_obj_set_value(lua_State *L, struct lua_lv_obj *lobj, int idx)
+{
+	int32_t value = luaL_checkinteger(L, idx);
+
+	if (lobj->lv_class != &lv_slider_class &&
+	    lobj->lv_class != &lv_bar_class)
+		luaL_error(L, "value is not supported by this object");
+
+	/* a slider is a bar */
+	if (lv_bar_get_value(lobj->lv_obj) == value) {
+		lua_lv_skip(L);
+		return;
+	}
+
+	if (lobj->lv_class == &lv_slider_class)
+		lv_slider_set_value(lobj->lv_obj, value, LV_ANIM_OFF);
+	else
+		lv_bar_set_value(lobj->lv_obj, value, LV_ANIM_OFF);
+}
+
+static void
+lua_lv_obj_set_data(lua_State *L, struct lua_lv_obj *lobj, int idx)
+{
+	lua_lv_obj_map_get(L, lobj->lv_obj);
+	lua_lv_obj_refs(L, -1, 1);
+	lua_pushvalue(L, idx);
+	lua_rawseti(L, -2, LUA_LV_OBJ_REF_USER_DATA);
+	lua_pop(L, 2);
+}
+
+struct lua_lv_style_prop {
+	const struct lua_lv_style	*s;
+	lv_style_value_t		 v;
+};
+
+/*
+ * obj:set{style = {shared = true, ...}} backs the props with an
+ * lv_style_t shared by every object given the same set, rather than
+ * copying them into a local style on each object. lists and repeated
+ * widgets tend to carry identical sets, so they cost one style entry
+ * per object instead of a local style and its prop array each.
+ *
+ * the sets are interned by the selector and the sorted props and
+ * values, and the styles are kept forever like lv.style() ones. the
+ * intern table is never pruned, so it grows with every distinct set
+ * a script uses. that suits the fixed looks of a ui, but values that
+ * keep changing belong in local styles rather than shared ones.
+ */
+static const char lua_lv_style_intern[] = "_lua_lv_style_intern";
+
+#define LUA_LV_STYLE_KEYLEN \
+	(sizeof(uint32_t) + \
+	 LUA_LV_OBJ_SET_STYLES * (sizeof(uint32_t) + sizeof(uint64_t)))
+
+static int
+lua_lv_style_prop_cmp(const void *a, const void *b)
+{
+	const struct lua_lv_style_prop *pa = a, *pb = b;
+
+	if (pa->s->prop < pb->s->prop)
+		return (-1);
+	if (pa->s->prop > pb->s->prop)
+		return (1);
+	return (0);
+}
+
+static int
+lua_lv_obj_set_shared_style(lua_State *L, struct lua_lv_obj *lobj, int sidx,
+    lv_style_selector_t selector, struct lua_lv_style_prop *props, size_t n)
+{
+	uint8_t key[LUA_LV_STYLE_KEYLEN];
+	size_t i, len = 0;
+	lv_style_t *style, *ostyle = NULL;
+	uint32_t p;
+	uint64_t v;
+	int changed;
+
+	qsort(props, n, sizeof(*props), lua_lv_style_prop_cmp);
+
+	p = selector;
+	memcpy(key + len, &p, sizeof(p));
+	len += sizeof(p);
+	for (i = 0; i < n; i++) {
+		p = props[i].s->prop;
+		memcpy(key + len, &p, sizeof(p));
+		len += sizeof(p);
+		v = lua_lv_style_value_key(props[i].s, props[i].v);
+		memcpy(key + len, &v, sizeof(v));
+		len += sizeof(v);
+	}
+
+	lua_rawgetp(L, LUA_REGISTRYINDEX, lua_lv_style_intern);
+	lua_pushlstring(L, (const char *)key, len);
+	if (lua_rawget(L, -2) == LUA_TUSERDATA)
+		style = lua_touserdata(L, -1);
+	else {
+		lua_pop(L, 1);
+
+		style = lua_newuserdata(L, sizeof(*style));
+		lv_style_init(style);
+		luaL_setmetatable(L, lua_lv_style_type);
+		for (i = 0; i < n; i++)
+			lv_style_set_prop(style, props[i].s->prop, props[i].v);
+
+		/* the style points at font udata, so keep them alive */
+		lua_newtable(L);
+		for (i = 0; i < n; i++) {
+			if (props[i].s->check != lua_lv_style_font)
+				continue;
+			lua_pushstring(L, props[i].s->name);
+			if (lua_rawget(L, sidx) == LUA_TUSERDATA)
+				lua_rawseti(L, -2, i + 1);
+			else
+				lua_pop(L, 1);
+		}
+		lua_setuservalue(L, -2);
+
+		lua_pushlstring(L, (const char *)key, len);
+		lua_pushvalue(L, -2);
+		lua_rawset(L, -4);
+	}
+
+	/* remember which shared style the object has at this selector */
+	lua_lv_obj_map_get(L, lobj->lv_obj);
+	lua_lv_obj_refs(L, -1, 1);
+	if (lua_rawgeti(L, -1, LUA_LV_OBJ_REF_STYLES) != LUA_TTABLE) {
+		lua_pop(L, 1);
+		lua_newtable(L);
+		lua_pushvalue(L, -1);
+		lua_rawseti(L, -3, LUA_LV_OBJ_REF_STYLES);
+	}
+	if (lua_rawgeti(L, -1, selector) == LUA_TUSERDATA)
+		ostyle = lua_touserdata(L, -1);
+	lua_pop(L, 1);
+
+	changed = (style != ostyle);
+	if (changed) {
+		lv_obj_enable_style_refresh(false);
+		if (ostyle != NULL)
+			lv_obj_remove_style(lobj->lv_obj, ostyle, selector);
+		lv_obj_add_style(lobj->lv_obj, style, selector);
+		lv_obj_enable_style_refresh(true);
+
+		lua_pushvalue(L, -4);
+		lua_rawseti(L, -2, selector);
+	} else
+		lua_lv_skip(L);
+
+	lua_pop(L, 5);
+
+	return (changed);
+}
+
+/* keys in a style table that aren't style props */
+static int
+lua_lv_obj_style_opt(lua_State *L, int idx)
+{
+	const char *k;
+
+	if (lua_type(L, idx) != LUA_TSTRING)
+		return (0);
+
+	k = lua_tostring(L, idx);
+	return (strcmp(k, "selector") == 0 || strcmp(k, "shared") == 0);
+}
+
+/*
+ * every local style prop set would normally refresh the object's
+ * style, invalidate it and mark its layout dirty. the props are
+ * checked in batches while lua can still raise errors, then applied
+ * with the refresh turned off, and the object is refreshed once.
+ * props that already have the requested value are left alone, and
+ * if nothing changed there is no refresh at all.
+ */
+static void
+lua_lv_obj_set_styles(lua_State *L, struct lua_lv_obj *lobj, int idx)
+{
+	struct lua_lv_style_prop props[LUA_LV_OBJ_SET_STYLES];
+	const struct lua_lv_style *s;
+	lv_style_selector_t selector = LV_PART_MAIN;
+	size_t i, n = 0;
+	int styles;
+	int shared;
+	int changed = 0;
+	int more;
+
+	luaL_checktype(L, idx, LUA_TTABLE);
+
+	if (lua_getfield(L, idx, "selector") != LUA_TNIL)
+		selector = luaL_checkinteger(L, -1);
+	lua_pop(L, 1);
+
+	lua_getfield(L, idx, "shared");
+	shared = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+
+	lua_rawgetp(L, LUA_REGISTRYINDEX, lua_lv_styles);
+	styles = lua_gettop(L);
+
+	lua_pushnil(L);
+	do {
+		more = lua_next(L, idx);
+		if (more) {
+			lua_pushvalue(L, -2);
+			lua_rawget(L, styles);
+
+			s = lua_touserdata(L, -1);
+			if (s != NULL) {
+				/* only a shared set can fill props */
+				if (n == nitems(props)) {
+					luaL_error(L, "too many shared "
+					    "style properties");
+				}
+				props[n].s = s;
+				props[n].v = s->check(L, lua_gettop(L) - 1);
+				if (!shared && lua_lv_obj_style_unchanged(
+				    lobj->lv_obj, s, props[n].v, selector))
+					lua_lv_skip(L);
+				else
+					n++;
+			} else if (!lua_lv_obj_style_opt(L, -3)) {
+				luaL_error(L, "unknown style property %s",
+				    lua_tostring(L, -3));
+			}
+
+			lua_pop(L, 2); /* pop value + s udata, keep key */
+		}
+
+		if (!shared &&
+		    (n == nitems(props) || (!more && n > 0))) {
+			lv_obj_enable_style_refresh(false);
+			for (i = 0; i < n; i++) {
+				lv_obj_set_local_style_prop(lobj->lv_obj,
+				    props[i].s->prop, props[i].v, selector);
+			}
+			lv_obj_enable_style_refresh(true);
+			changed += n;
+			n = 0;
+		}
+	} while (more);
+
+	lua_pop(L, 1);
+
+	if (shared && n > 0)
+		changed = lua_lv_obj_set_shared_style(L, lobj, idx,
+		    selector, props, n);
+
+	if (changed)
+		lv_obj_refresh_style(lobj->lv_obj, selector, LV_STYLE_PROP_ANY);
+}
+
+static const struct lua_lv_obj_setter lua_lv_obj_setter_list[] = {
+	{ "x",			lua_lv_obj_set_x },
+	{ "y",			lua_lv_obj_set_y },
+	{ "pos",		lua_lv_obj_set_pos },
+	{ "w",			lua_lv_obj_set_width },
+	{ "width",		lua_lv_obj_set_width },
+	{ "h",			lua_lv_obj_set_height },
+	{ "height",		lua_lv_obj_set_height },
+	{ "size",		lua_lv_obj_set_size },
+	{ "align",		lua_lv_obj_set_align },
+	{ "center",		lua_lv_obj_set_center },
+	{ "flags",		lua_lv_obj_set_flags },
+	{ "states",		lua_lv_obj_set_states },
+	{ "text",		lua_lv_obj_set_text },
+	{ "value",		lua_lv_obj_set_value },
+	{ "data",		lua_lv_obj_set_data },
+	{ "style",		lua_lv_obj_set_styles },
+
+	/* these are only meaningful to lv.build */
+	{ "type",		NULL },
+	{ "name",		NULL },
+	{ "events",		NULL },
+	{ "children",		NULL },
+};
+
+static void
+lua_lv_obj_setters_init(lua_State *L)
+{
+	size_t i;
+
+	lua_newtable(L);
+	for (i = 0; i < nitems(lua_lv_obj_setter_list); i++) {
+		const struct lua_lv_obj_setter *s = &lua_lv_obj_setter_list[i];
+
+		lua_pushstring(L, s->name);
+		lua_pushlightuserdata(L, (void *)s);
+		lua_rawset(L, -3);
+	}
+
+	lua_rawsetp(L, LUA_REGISTRYINDEX, lua_lv_obj_setters);
+}
+
+static void
+lua_lv_obj_set_table(lua_State *L, struct lua_lv_obj *lobj, int tidx,
+    int build)
+{
+	const struct lua_lv_obj_setter *s;
+	int setters, top;
+	size_t i;
+
+	lua_rawgetp(L, LUA_REGISTRYINDEX, lua_lv_obj_setters);
+	setters = lua_gettop(L);
+
+	lua_pushnil(L);
+	while (lua_next(L, tidx)) {
+		lua_pushvalue(L, -2);
+		lua_rawget(L, setters);
+
+		s = lua_touserdata(L, -1);
+		if (s == NULL || (s->set == NULL && !build)) {
+			luaL_error(L, "unknown property %s",
+			    lua_tostring(L, -3));
+		}
+		lua_pop(L, 2); /* keep key */
+	}
+
+	lua_pop(L, 1);
+
+	top = lua_gettop(L);
+	for (i = 0; i < nitems(lua_lv_obj_setter_list); i++) {
+		s = &lua_lv_obj_setter_list[i];
+		if (s->set == NULL)
+			continue;
+
+		lua_pushstring(L, s->name);
+		if (lua_rawget(L, tidx) != LUA_TNIL)
+			(*s->set)(L, lobj, top + 1);
+		lua_settop(L, top);
+	}
+}
+
+static int
+lua_lv_obj_set(lua_State *L)
+{
+	struct lua_lv_obj *lobj = lua_lv_obj_checkudata(L, 1);
+
+	luaL_argcheck(L, lobj->lv_obj != NULL, 1,
+	    LUA_LV_OBJ_STR " has been deleted");
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+
+	lua_lv_obj_set_table(L, lobj, 2, 0);
+
+	return (0);
+}
+
+/*
+ * lua_lv_obj metatable methods
+ */
+
+static const luaL_Reg lua_lv_obj_methods[] = {
+	{ "center",		lua_lv_obj_center },
+	{ "del",		lua_lv_obj_del },
+	{ "del_async",		lua_lv_obj_del_async },
+	{ "remove_style_all",	lua_lv_obj_remove_style_all },
+	{ "invalidate",		lua_lv_obj_invalidate },
+	{ "get_data",		lua_lv_obj_get_data },
+
 	{ "size",		lua_lv_obj_size },
 	{ "refr_size",		lua_lv_obj_refr_size },
 	{ "w",			lua_lv_obj_width },
@@ -1956,6 +2830,8 @@ static const luaL_Reg lua_lv_obj_methods[] = {
 	{ "set_style",		lua_lv_obj_set_style },
 	{ "add_style",		lua_lv_obj_add_style },
 
+	{ "set",		lua_lv_obj_set },
+
 	{ NULL,			NULL }
 };
 
@@ -1976,7 +2852,10 @@ lua_lv_bar_value(lua_State *L)
 		/* FALLTHROUGH */
 	case 2:
 		value = luaL_checkinteger(L, 2);
-		lv_bar_set_value(obj, value, anim);
+		if (lv_bar_get_value(obj) == value)
+			lua_lv_skip(L);
+		else
+			lv_bar_set_value(obj, value, anim);
 		break;
 	case 1:
 		break;
@@ -2003,7 +2882,10 @@ lua_lv_bar_start_value(lua_State *L)
 		/* FALLTHROUGH */
 	case 2:
 		value = luaL_checkinteger(L, 2);
-		lv_bar_set_start_value(obj, value, anim);
+		if (lv_bar_get_start_value(obj) == value)
+			lua_lv_skip(L);
+		else
+			lv_bar_set_start_value(obj, value, anim);
 		break;
 	case 1:
 		break;
@@ -2154,7 +3036,8 @@ static const char lua_lv_btnmatrix_map_end[] = ""; /* WHY */
 static int
 lua_lv_btnmatrix_map__gc(lua_State *L)
 {
-	char **map = luaL_checkudata(L, 1, lua_lv_btnmatrix_map);
+	char **map = lua_lv_checkudata(L, 1,
+	    lua_lv_types(L)->btnmatrix_map, lua_lv_btnmatrix_map);
 	char *e;
 	size_t i = 0;
 
@@ -2242,11 +3125,15 @@ lua_lv_checkbox_text(lua_State *L)
 {
 	lv_obj_t *obj = lua_lv_check_obj_class(L, 1, &lv_checkbox_class);
 	const char *str;
+	size_t len;
 
 	switch (lua_gettop(L)) {
 	case 2:
-		str = luaL_checkstring(L, 2);
-		lv_checkbox_set_text(obj, str);
+		str = luaL_checklstring(L, 2, &len);
+		if (lua_lv_text_unchanged(lv_checkbox_get_text(obj), str, len))
+			lua_lv_skip(L);
+		else
+			lv_checkbox_set_text(obj, str);
 		break;
 	case 1:
 		str = lv_checkbox_get_text(obj);
@@ -2444,11 +3331,15 @@ lua_lv_label_text(lua_State *L)
 {
 	lv_obj_t *obj = lua_lv_check_obj_class(L, 1, &lv_label_class);
 	const char *str;
+	size_t len;
 
 	switch (lua_gettop(L)) {
 	case 2:
-		str = luaL_checkstring(L, 2);
-		lv_label_set_text(obj, str);
+		str = luaL_checklstring(L, 2, &len);
+		if (lua_lv_text_unchanged(lv_label_get_text(obj), str, len))
+			lua_lv_skip(L);
+		else
+			lv_label_set_text(obj, str);
 		break;
 	case 1:
 		str = lv_label_get_text(obj);
@@ -3244,6 +4135,207 @@ lua_lv_constants(lua_State *L)
 	    lua_lv_misc_constants, nitems(lua_lv_misc_constants));
 }
 
+/*
+ * lv.build(parent, spec) creates a tree of objects from a table like:
+ *
+ *	{ type = "obj", name = "panel", size = { 480, 480 },
+ *	  children = {
+ *	    { type = "label", text = "Light" },
+ *	    { type = "switch", name = "power",
+ *	      events = { [lv.EVENT.VALUE_CHANGED] = fn } },
+ *	  } }
+ *
+ * other keys are handled like obj:set{}. it returns a table of the
+ * named objects, and the object at the root of the tree. if the spec
+ * is bad partway through, the objects created so far are deleted
+ * before the error is raised.
+ */
+
+#define LUA_LV_BUILD_MAXDEPTH	32
+
+struct lua_lv_build_type {
+	const char		*name;
+	lv_obj_t		*(*create)(lv_obj_t *);
+};
+
+static const char lua_lv_build_types[] = "_lua_lv_build_types";
+
+static const struct lua_lv_build_type lua_lv_build_type_list[] = {
+	{ "obj",		lv_obj_create },
+	{ "object",		lv_obj_create },
+	{ "bar",		lv_bar_create },
+	{ "btn",		lv_btn_create },
+	{ "button",		lv_btn_create },
+	{ "btnmatrix",		lv_btnmatrix_create },
+	{ "checkbox",		lv_checkbox_create },
+	{ "img",		lv_img_create },
+	{ "image",		lv_img_create },
+	{ "label",		lv_label_create },
+	{ "led",		lv_led_create },
+	{ "slider",		lv_slider_create },
+	{ "switch",		lv_switch_create },
+	{ "tileview",		lv_tileview_create },
+};
+
+static void
+lua_lv_build_types_init(lua_State *L)
+{
+	size_t i;
+
+	lua_newtable(L);
+	for (i = 0; i < nitems(lua_lv_build_type_list); i++) {
+		const struct lua_lv_build_type *t = &lua_lv_build_type_list[i];
+
+		lua_pushstring(L, t->name);
+		lua_pushlightuserdata(L, (void *)t);
+		lua_rawset(L, -3);
+	}
+
+	lua_rawsetp(L, LUA_REGISTRYINDEX, lua_lv_build_types);
+}
+
+static void
+lua_lv_build_events(lua_State *L, int oidx, int eidx)
+{
+	lv_event_code_t event;
+	int top, fidx, aidx;
+
+	lua_pushnil(L);
+	while (lua_next(L, eidx)) {
+		event = luaL_checkinteger(L, -2);
+		top = fidx = lua_gettop(L);
+		aidx = 0;
+
+		/* a handler can be fn, or { fn, arg } */
+		if (lua_istable(L, top)) {
+			lua_rawgeti(L, top, 1);
+			lua_rawgeti(L, top, 2);
+			fidx = top + 1;
+			aidx = top + 2;
+		}
+
+		if (!lua_isfunction(L, fidx))
+			luaL_error(L, "event handler must be a function");
+		lua_lv_obj_event_add(L, oidx, event, fidx, aidx);
+
+		lua_settop(L, top - 1); /* keep key */
+	}
+}
+
+/* leaves the new object on the top of the stack */
+static void
+lua_lv_build_node(lua_State *L, lv_obj_t *parent, int sidx, int names,
+    lv_obj_t **rootp, unsigned int depth)
+{
+	const struct lua_lv_build_type *t;
+	struct lua_lv_obj *lobj;
+	lv_obj_t *obj;
+	lua_Integer i, n;
+	int oidx, cidx;
+
+	if (depth > LUA_LV_BUILD_MAXDEPTH)
+		luaL_error(L, "ui spec is nested too deeply");
+	luaL_checkstack(L, 16, "ui spec");
+	if (!lua_istable(L, sidx))
+		luaL_error(L, "ui spec must be a table");
+
+	lua_rawgetp(L, LUA_REGISTRYINDEX, lua_lv_build_types);
+	if (lua_getfield(L, sidx, "type") == LUA_TNIL) {
+		lua_pop(L, 1);
+		lua_pushliteral(L, "obj");
+	}
+	lua_pushvalue(L, -1);
+	lua_rawget(L, -3);
+	t = lua_touserdata(L, -1);
+	if (t == NULL)
+		luaL_error(L, "unknown ui type %s", lua_tostring(L, -2));
+	lua_pop(L, 3);
+
+	obj = (*t->create)(parent);
+	if (obj == NULL)
+		luaL_error(L, "%s create failed", t->name);
+	if (depth == 0)
+		*rootp = obj;
+
+	lobj = lua_lv_obj_register(L, obj);
+	oidx = lua_gettop(L);
+
+	lua_lv_obj_set_table(L, lobj, sidx, 1);
+
+	if (lua_getfield(L, sidx, "name") != LUA_TNIL) {
+		lua_pushvalue(L, oidx);
+		lua_rawset(L, names);
+	} else
+		lua_pop(L, 1);
+
+	if (lua_getfield(L, sidx, "events") != LUA_TNIL)
+		lua_lv_build_events(L, oidx, lua_gettop(L));
+	lua_settop(L, oidx);
+
+	if (lua_getfield(L, sidx, "children") != LUA_TNIL) {
+		cidx = lua_gettop(L);
+		luaL_checktype(L, cidx, LUA_TTABLE);
+
+		n = lua_rawlen(L, cidx);
+		for (i = 1; i <= n; i++) {
+			lua_rawgeti(L, cidx, i);
+			lua_lv_build_node(L, obj, lua_gettop(L), names,
+			    rootp, depth + 1);
+			lua_settop(L, cidx);
+		}
+	}
+	lua_settop(L, oidx);
+}
+
+/* called as walk(rootp, parent, spec, names) */
+static int
+lua_lv_build_walk(lua_State *L)
+{
+	lv_obj_t **rootp = lua_touserdata(L, 1);
+	lv_obj_t *parent = lua_touserdata(L, 2);
+
+	lua_lv_build_node(L, parent, 3, 4, rootp, 0);
+
+	return (1);
+}
+
+static int
+lua_lv_build(lua_State *L)
+{
+	lv_obj_t *parent = NULL;
+	lv_obj_t *root = NULL;
+	struct lua_lv_obj *lroot;
+
+	if (!lua_isnoneornil(L, 1))
+		parent = lua_lv_check_obj(L, 1);
+	luaL_checktype(L, 2, LUA_TTABLE);
+	lua_settop(L, 2);
+
+	lua_newtable(L); /* 3: names */
+
+	lua_pushcfunction(L, lua_lv_build_walk);
+	lua_pushlightuserdata(L, &root);
+	lua_pushlightuserdata(L, parent);
+	lua_pushvalue(L, 2);
+	lua_pushvalue(L, 3);
+	if (lua_pcall(L, 4, 1, 0) != LUA_OK) {
+		/* don't leave half a tree on the screen */
+		if (root != NULL)
+			lv_obj_del(root);
+		return (lua_error(L));
+	}
+	lroot = lua_touserdata(L, 4);
+
+	/*
+	 * nothing above asks lvgl where anything is, so the layout
+	 * has been left dirty while the tree was built. work it out
+	 * once now so the objects are ready to use.
+	 */
+	lv_obj_update_layout(lroot->lv_obj);
+
+	return (2);
+}
+
 static const luaL_Reg lua_lv[] = {
 	{ "obj",		lua_lv_obj_create },
 	{ "object",		lua_lv_obj_create },
@@ -3262,6 +4354,8 @@ static const luaL_Reg lua_lv[] = {
 	{ "tabview",		lua_lv_tabview_create },
 	{ "tileview",		lua_lv_tileview_create },
 
+	{ "build",		lua_lv_build },
+
 	{ "style",		lua_lv_style_create },
 	{ "ft",			lua_lv_font_create },
 	{ "ttf",		lua_lv_font_create },
@@ -3292,45 +4386,98 @@ lua_lv_state__gc(lua_State *L)
 	return (0);
 }
 
-int
-luaopen_lv(lua_State *L)
+/* add the methods for class and everything it inherits from */
+static void
+lua_lv_obj_class_setfuncs(lua_State *L, const lv_obj_class_t *class)
 {
-	struct lua_lv_obj *lstate;
-	lv_obj_t *scr;
-	struct lua_lv_obj *lscr;
 	size_t i;
 
+	if (class->base_class != NULL)
+		lua_lv_obj_class_setfuncs(L, class->base_class);
+
 	for (i = 0; i < nitems(lua_lv_obj_classes); i++) {
 		const struct lua_lv_obj_class *c = &lua_lv_obj_classes[i];
 
-		lua_newtable(L);
-		luaL_setfuncs(L, c->methods, 0);
-		lua_rawsetp(L, LUA_REGISTRYINDEX, c->obj_class);
+		if (c->obj_class == class) {
+			luaL_setfuncs(L, c->methods, 0);
+			break;
+		}
 	}
+}
 
-	lua_builtin_lv_fonts_init(L);
-	lua_lv_palette_init(L);
-	lua_lv_styles_init(L);
+static void
+lua_lv_obj_class_init(lua_State *L, const lv_obj_class_t *class)
+{
+	lua_newtable(L); /* metatable */
 
-	if (luaL_newmetatable(L, lua_lv_obj_type)) {
-		lua_pushliteral(L, "__gc");
-		lua_pushcfunction(L, lua_lv_obj__gc);
-		lua_settable(L, -3);
+	lua_pushliteral(L, "__gc");
+	lua_pushcfunction(L, lua_lv_obj__gc);
+	lua_settable(L, -3);
 
+	lua_pushliteral(L, "__index");
+	lua_newtable(L);
+	lua_lv_obj_class_setfuncs(L, class);
+	if (luaL_newmetatable(L, lua_lv_obj_methods_type)) {
 		lua_pushliteral(L, "__index");
-		lua_pushcfunction(L, lua_lv_obj__index);
+		lua_pushcfunction(L, lua_lv_obj_methods__index);
 		lua_settable(L, -3);
+	}
+	lua_setmetatable(L, -2);
+	lua_settable(L, -3);
 
-		lua_pushliteral(L, "__newindex");
-		lua_pushcfunction(L, lua_lv_obj__newindex);
-		lua_settable(L, -3);
+	lua_pushliteral(L, "__newindex");
+	lua_pushcfunction(L, lua_lv_obj__newindex);
+	lua_settable(L, -3);
 
-		lua_pushliteral(L, "__metatable");
-		lua_pushliteral(L, "nope");
-		lua_settable(L, -3);
-	}
+	lua_pushliteral(L, "__metatable");
+	lua_pushliteral(L, "nope");
+	lua_settable(L, -3);
+
+	/* mark it for lua_lv_obj_checkudata */
+	luaL_newmetatable(L, lua_lv_obj_class_type);
+	lua_lv_types(L)->obj = lua_topointer(L, -1);
+	lua_setmetatable(L, -2);
+
+	lua_rawsetp(L, LUA_REGISTRYINDEX, class);
+}
+
+int
+luaopen_lv(lua_State *L)
+{
+	struct lua_lv_obj *lstate;
+	struct lua_lv_event *levent;
+	struct lua_lv_types *types;
+	lua_State *ML;
+	lv_obj_t *scr;
+	struct lua_lv_obj *lscr;
+	size_t i;
+
+	types = lua_newuserdata(L, sizeof(*types));
+	memset(types, 0, sizeof(*types));
+	lua_rawsetp(L, LUA_REGISTRYINDEX, lua_lv_types_key);
+
+	/* threads copy the main thread's extra space when created */
+	*(struct lua_lv_types **)lua_getextraspace(L) = types;
+	lua_rawgeti(L, LUA_REGISTRYINDEX, LUA_RIDX_MAINTHREAD);
+	ML = lua_tothread(L, -1);
+	*(struct lua_lv_types **)lua_getextraspace(ML) = types;
 	lua_pop(L, 1);
 
+	lua_newtable(L);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, lua_lv_obj_map);
+
+	lua_newtable(L);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, lua_lv_style_intern);
+
+	for (i = 0; i < nitems(lua_lv_obj_classes); i++)
+		lua_lv_obj_class_init(L, lua_lv_obj_classes[i].obj_class);
+
+	lua_builtin_lv_fonts_init(L);
+	lua_lv_palette_init(L);
+	lua_lv_styles_init(L);
+	lua_lv_obj_setters_init(L);
+	lua_lv_build_types_init(L);
+
 	if (luaL_newmetatable(L, lua_lv_style_type)) {
 		lua_pushliteral(L, "__gc");
 		lua_pushcfunction(L, lua_lv_style__gc);
@@ -3360,6 +4507,7 @@ luaopen_lv(lua_State *L)
 		lua_pushcfunction(L, lua_lv_style_reset);
 		lua_settable(L, -3);
 	}
+	types->style = lua_topointer(L, -1);
 	lua_pop(L, 1);
 
 	if (luaL_newmetatable(L, lua_lv_font_type)) {
@@ -3379,8 +4527,26 @@ luaopen_lv(lua_State *L)
 		lua_pushliteral(L, "nope");
 		lua_settable(L, -3);
 	}
+	types->font = lua_topointer(L, -1);
 	lua_pop(L, 1);
 
+	if (luaL_newmetatable(L, lua_lv_event_type)) {
+		lua_pushliteral(L, "__index");
+		lua_pushcfunction(L, lua_lv_event__index);
+		lua_settable(L, -3);
+
+		lua_pushliteral(L, "__metatable");
+		lua_pushliteral(L, "nope");
+		lua_settable(L, -3);
+	}
+	types->event = lua_topointer(L, -1);
+	lua_pop(L, 1);
+
+	levent = lua_newuserdata(L, sizeof(*levent));
+	levent->lv_event = NULL;
+	luaL_setmetatable(L, lua_lv_event_type);
+	lua_rawsetp(L, LUA_REGISTRYINDEX, lua_lv_event_type);
+
 	if (luaL_newmetatable(L, lua_lv_state)) {
 		lua_pushliteral(L, "__gc");
 		lua_pushcfunction(L, lua_lv_state__gc);
@@ -3402,6 +4568,7 @@ luaopen_lv(lua_State *L)
 		lua_pushliteral(L, "nope");
 		lua_settable(L, -3);
 	}
+	types->btnmatrix_map = lua_topointer(L, -1);
 	lua_pop(L, 1);
 
 	lua_newtable(L);
@@ -20,5 +20,8 @@
 #define _LUA_LV_H_
 
 int luaopen_lv(lua_State *);
+lv_obj_t *lua_lv_checkobj(lua_State *, int, const lv_obj_class_t *);
+uint64_t lua_lv_skipped(lua_State *);
+void lua_lv_skipped_reset(lua_State *);
 
 #endif /* _LUA_LV_H_ */
@@ -20,7 +20,11 @@
 #include <sys/ioctl.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <sys/param.h> /* for MAXHOSTNAMELEN */
+#include <sys/tree.h>
+#include <sys/stat.h>
+#include <sys/time.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,6 +34,7 @@
 #include <fcntl.h>
 #include <time.h>
 #include <netdb.h>
+#include <asr.h>
 #include <assert.h>
 #include <errno.h>
 #include <err.h>
@@ -47,6 +52,7 @@
 #include "lvgl/demos/lv_demos.h"
 #include "wslv_drm.h"
 #include "lua_lv.h"
+#include "lua_json.h"
 
 #include "amqtt/amqtt.h"
 
@@ -138,17 +144,261 @@ struct wslv_pointer {
 };
 TAILQ_HEAD(wslv_pointer_list, wslv_pointer);
 
+typedef void (*wslv_cmnd_builtin)(struct wslv_softc *, const char *,
+	    const char *, size_t);
+
+/* handlers for cmnd/DEVNAME/ topics, hashed on the rest of the topic */
+struct wslv_cmnd {
+	char				*c_name;
+	size_t				 c_len;
+	uint32_t			 c_hash;
+
+	wslv_cmnd_builtin		 c_builtin;
+	int				 c_handler; /* lua ref */
+
+	SLIST_ENTRY(wslv_cmnd)		 c_entry;
+};
+SLIST_HEAD(wslv_cmnd_bucket, wslv_cmnd);
+
+#define WSLV_CMNDS_BUCKETS		 16
+
+struct wslv_cmnds {
+	struct wslv_cmnd_bucket		*cs_buckets;
+	unsigned int			 cs_mask;
+	unsigned int			 cs_count;
+};
+
+struct wslv_topic_node;
+
+/* payloads go straight into an image widget without visiting lua */
+struct wslv_image_sink {
+	lv_obj_t			*is_obj;
+	lv_draw_buf_t			*is_img;	/* decoded pixels */
+};
+
 struct wslv_lua_mqtt_sub {
 	char				*filter;
 	size_t				 len;
 	int				 handler; /* lua ref */
 
 	unsigned int			 refs;
+	enum mqtt_qos			 qos;
+	int				 conflate;
+	struct wslv_image_sink		*sink;
 
+	struct wslv_topic_node		*node;
+	TAILQ_ENTRY(wslv_lua_mqtt_sub)	 nentry; /* node->tn_subs */
 	TAILQ_ENTRY(wslv_lua_mqtt_sub)	 entry;
 };
 TAILQ_HEAD(wslv_lua_mqtt_subs, wslv_lua_mqtt_sub);
 
+RBT_HEAD(wslv_topic_nodes, wslv_topic_node);
+
+struct wslv_topic_node {
+	struct wslv_topic_node		*tn_parent;
+	RBT_ENTRY(wslv_topic_node)	 tn_entry;
+	struct wslv_topic_nodes		 tn_children;
+	struct wslv_topic_node		*tn_plus;
+	struct wslv_topic_node		*tn_hash;
+
+	struct wslv_lua_mqtt_subs	 tn_subs;
+
+	char				*tn_name;
+	size_t				 tn_len;
+};
+
+RBT_PROTOTYPE(wslv_topic_nodes, wslv_topic_node, tn_entry,
+    wslv_topic_node_cmp);
+
+/* the latest message on a topic, held until the next frame */
+struct wslv_lua_mqtt_pend {
+	char				*topic;
+	size_t				 topic_len;
+	char				*payload;
+	size_t				 payload_len;
+	int				 qos;
+
+	RBT_ENTRY(wslv_lua_mqtt_pend)	 rbentry;
+	TAILQ_ENTRY(wslv_lua_mqtt_pend)	 entry;
+};
+RBT_HEAD(wslv_lua_mqtt_pend_tree, wslv_lua_mqtt_pend);
+TAILQ_HEAD(wslv_lua_mqtt_pend_list, wslv_lua_mqtt_pend);
+
+RBT_PROTOTYPE(wslv_lua_mqtt_pend_tree, wslv_lua_mqtt_pend, rbentry,
+    wslv_lua_mqtt_pend_cmp);
+
+/* limits on how a lua script can publish to a topic */
+struct wslv_pub_policy {
+	struct wslv_softc		*p_sc;
+	char				*p_topic;
+	size_t				 p_topic_len;
+
+	unsigned int			 p_interval;	/* ms */
+	int				 p_dedup;
+	unsigned int			 p_inflight_max;
+
+	uint32_t			 p_last;	/* wslv_ms() */
+	int				 p_sent;
+	char				*p_sent_payload;
+	size_t				 p_sent_len;
+	unsigned int			 p_inflight;
+	uint64_t			 p_gen;
+
+	int				 p_pending;
+	char				*p_pend_payload;
+	size_t				 p_pend_len;
+	enum mqtt_qos			 p_pend_qos;
+	int				 p_pend_retain;
+	struct event			 p_ev;
+
+	int				 p_blocked;
+	TAILQ_ENTRY(wslv_pub_policy)	 p_bentry;
+	RBT_ENTRY(wslv_pub_policy)	 p_entry;
+};
+RBT_HEAD(wslv_pub_policies, wslv_pub_policy);
+TAILQ_HEAD(wslv_pub_blocked, wslv_pub_policy);
+
+RBT_PROTOTYPE(wslv_pub_policies, wslv_pub_policy, p_entry,
+    wslv_pub_policy_cmp);
+
+#define WSLV_LAST_BYTES			 (256 * 1024)
+
+/* the last message seen on each topic, kept across lua reloads */
+struct wslv_last {
+	char				*l_topic;
+	size_t				 l_topic_len;
+	char				*l_payload;
+	size_t				 l_payload_len;
+
+	RBT_ENTRY(wslv_last)		 l_rbentry;
+	TAILQ_ENTRY(wslv_last)		 l_entry; /* lru, oldest first */
+};
+RBT_HEAD(wslv_last_tree, wslv_last);
+TAILQ_HEAD(wslv_last_list, wslv_last);
+
+RBT_PROTOTYPE(wslv_last_tree, wslv_last, l_rbentry, wslv_last_cmp);
+
+#define WSLV_MQTT_S_IDLE		 0 /* waiting to (re)connect */
+#define WSLV_MQTT_S_RESOLVING		 1
+#define WSLV_MQTT_S_DIALING		 2 /* tcp handshakes in flight */
+#define WSLV_MQTT_S_CONNECTING		 3 /* waiting for connack */
+#define WSLV_MQTT_S_CONNECTED		 4
+
+#define WSLV_MQTT_DIAL_DELAY		 250	/* ms */
+#define WSLV_MQTT_CONNECT_TIMEOUT	 10	/* seconds */
+
+#define WSLV_MQTT_BACKOFF_MIN		 100	/* ms */
+#define WSLV_MQTT_BACKOFF_MAX		 30000	/* ms */
+
+#define WSLV_MQTT_QUEUE_MAX		 128
+#define WSLV_MQTT_QUEUE_BYTES		 (64 * 1024)
+
+#define WSLV_MQTT_WBUF_SIZE		 (64 * 1024) /* must be a power of 2 */
+
+#define WSLV_MQTT_RBUF_MIN		 (8 * 1024)
+#define WSLV_MQTT_RBUF_MAX		 (256 * 1024)
+#define WSLV_MQTT_RD_BUDGET		 (512 * 1024) /* per wakeup */
+
+struct wslv_mqtt_dial {
+	struct wslv_softc		*d_sc;
+	int				 d_fd;
+	struct event			 d_ev;
+
+	TAILQ_ENTRY(wslv_mqtt_dial)	 d_entry;
+};
+TAILQ_HEAD(wslv_mqtt_dials, wslv_mqtt_dial);
+
+/*
+ * size classed pools for the message copies wslv holds on to in the
+ * last value cache, the offline queue, and the conflation entries,
+ * so they don't fragment the heap lvgl and lua are using. the topic
+ * and payload amqtt passes to on_message are malloc'd inside amqtt
+ * and aren't pooled.
+ */
+#define WSLV_POOL_MINSHIFT		 5	/* 32 bytes */
+#define WSLV_POOL_CLASSES		 8	/* up to 4k */
+#define WSLV_POOL_MAX \
+	(1 << (WSLV_POOL_MINSHIFT + WSLV_POOL_CLASSES - 1))
+#define WSLV_POOL_SLAB			 (64 * 1024)
+
+struct wslv_pool_item {
+	struct wslv_pool_item		*next;
+};
+
+struct wslv_pool {
+	struct wslv_pool_item		*p_free;
+	unsigned int			 p_inuse;
+	unsigned int			 p_hwm;
+	unsigned int			 p_slabs;
+};
+
+/*
+ * runtime metrics published in tele/DEVNAME/STATUS. the period
+ * counters are reset each time the document is published.
+ */
+#define WSLV_TELE_PERIOD_MIN		 10	/* seconds */
+#define WSLV_TELE_PERIOD_MAX		 86400
+#define WSLV_TELE_PERIOD_DEFAULT	 300
+#define WSLV_TELE_BUFLEN		 4096
+
+#define WSLV_TELE_M_LOOP		 (1 << 0)
+#define WSLV_TELE_M_FRAMES		 (1 << 1)
+#define WSLV_TELE_M_MQTT		 (1 << 2)
+#define WSLV_TELE_M_LUA			 (1 << 3)
+#define WSLV_TELE_M_POOL		 (1 << 4)
+#define WSLV_TELE_M_LVGL		 (1 << 5)
+#define WSLV_TELE_M_DEFAULT \
+	(WSLV_TELE_M_LOOP | WSLV_TELE_M_FRAMES | WSLV_TELE_M_MQTT | \
+	 WSLV_TELE_M_LUA)
+
+static const char *wslv_tele_metric_names[] = {
+	"loop", "frames", "mqtt", "lua", "pool", "lvgl", NULL,
+};
+
+#define WSLV_FRAME_BUCKETS		 64	/* 1ms each, the last is >= */
+
+struct wslv_metrics {
+	uint32_t			 m_period_start;	/* ms */
+	uint64_t			 m_wakeups;
+
+	uint32_t			 m_frame_start;		/* ms */
+	int				 m_frame_busy;
+	unsigned int			 m_frames;
+	unsigned int			 m_frame_max;
+	unsigned int			 m_frame_hist[WSLV_FRAME_BUCKETS];
+
+	uint64_t			 m_mqtt_rd_bytes;
+};
+
+/* publishes held while the broker is unreachable */
+struct wslv_mqtt_msg {
+	char				*topic;
+	size_t				 topic_len;
+	char				*payload;
+	size_t				 payload_len;
+	enum mqtt_qos			 qos;
+	int				 retain;
+
+	TAILQ_ENTRY(wslv_mqtt_msg)	 entry;
+};
+TAILQ_HEAD(wslv_mqtt_msgs, wslv_mqtt_msg);
+
+/*
+ * packets from amqtt are gathered in this ring and written out
+ * together when the socket is writable.
+ */
+struct wslv_mqtt_wbuf {
+	uint8_t				*wb_buf;
+	size_t				 wb_prod;
+	size_t				 wb_cons;
+	int				 wb_full;
+
+	uint64_t			 wb_writes;
+	uint64_t			 wb_bytes;
+	uint64_t			 wb_pkts;
+	uint64_t			 wb_gen; /* bumped when drained */
+};
+
 struct wslv_softc {
 	const char			*sc_name;
 
@@ -187,24 +437,73 @@ struct wslv_softc {
 	const char			*sc_mqtt_will_topic;
 	size_t				 sc_mqtt_will_topic_len;
 	struct mqtt_conn		*sc_mqtt_conn;
+	int				 sc_mqtt_state;
 
+	struct event_asr		*sc_mqtt_asr;
 	struct addrinfo			*sc_mqtt_res0;
+	struct addrinfo			*sc_mqtt_res;
+	struct wslv_mqtt_dials		 sc_mqtt_dials;
+	struct event			 sc_mqtt_ev_dial;
+	struct event			 sc_mqtt_ev_connto;
+
 	int				 sc_mqtt_fd;
 	struct event			 sc_mqtt_ev_rd;
 	struct event			 sc_mqtt_ev_wr;
 	struct event			 sc_mqtt_ev_to;
+	struct wslv_mqtt_wbuf		 sc_mqtt_wbuf;
+	uint8_t				*sc_mqtt_rbuf;
+	size_t				 sc_mqtt_rbuf_len;
+
+	unsigned int			 sc_mqtt_backoff;
+	struct event			 sc_mqtt_ev_backoff;
+	unsigned int			 sc_mqtt_reconnects;
+
+	struct wslv_pool		 sc_pools[WSLV_POOL_CLASSES];
+	uint64_t			 sc_pool_big;
+
+	struct wslv_mqtt_msgs		 sc_mqtt_queue;
+	unsigned int			 sc_mqtt_queue_len;
+	size_t				 sc_mqtt_queue_bytes;
+	unsigned int			 sc_mqtt_queue_drops;
 
 	struct event			 sc_mqtt_tele_period;
+	unsigned int			 sc_tele_secs;
+	unsigned int			 sc_tele_metrics;
+	char				*sc_tele_buf;
+	struct wslv_metrics		 sc_metrics;
+
+	struct wslv_cmnds		 sc_cmnds;
+
+	struct wslv_pub_policies	 sc_pub_policies;
+	struct wslv_pub_blocked		 sc_pub_blocked;
+	uint64_t			 sc_pub_deduped;
+	uint64_t			 sc_pub_limited;
 
 	struct event			 sc_clocktick;
 
 	lua_State			*sc_L;
 	const char			*sc_L_script;
+	const char			*sc_L_cachedir;
+	struct timespec			 sc_L_load_time;
+	unsigned int			 sc_L_loads;
+	unsigned int			 sc_L_cached;
 	int				 sc_L_reload;
 	lv_obj_t			*sc_L_reload_btn;
 	int				 sc_L_in_cmnd;
 
 	struct wslv_lua_mqtt_subs	 sc_L_subs;
+	struct wslv_lua_mqtt_subs	 sc_L_unsubs;
+	struct wslv_topic_node		*sc_L_topics;
+
+	struct wslv_lua_mqtt_pend_tree	 sc_L_pend_tree;
+	struct wslv_lua_mqtt_pend_list	 sc_L_pend_list;
+	uint64_t			 sc_L_conflated;
+
+	unsigned int			 sc_image_sinks;
+
+	struct wslv_last_tree		 sc_last_tree;
+	struct wslv_last_list		 sc_last_list;
+	size_t				 sc_last_bytes;
 };
 
 struct wslv_softc _wslv = {
@@ -217,11 +516,28 @@ struct wslv_softc _wslv = {
 	.sc_mqtt_device		= NULL,
 	.sc_mqtt_user		= NULL,
 	.sc_mqtt_pass		= NULL,
+	.sc_mqtt_state		= WSLV_MQTT_S_IDLE,
+	.sc_tele_secs		= WSLV_TELE_PERIOD_DEFAULT,
+	.sc_tele_metrics	= WSLV_TELE_M_DEFAULT,
+	.sc_mqtt_fd		= -1,
+	.sc_mqtt_dials		= TAILQ_HEAD_INITIALIZER(_wslv.sc_mqtt_dials),
+	.sc_mqtt_queue		= TAILQ_HEAD_INITIALIZER(_wslv.sc_mqtt_queue),
+	.sc_pub_blocked		= TAILQ_HEAD_INITIALIZER(_wslv.sc_pub_blocked),
 
 	.sc_L_subs		= TAILQ_HEAD_INITIALIZER(_wslv.sc_L_subs),
+	.sc_L_unsubs		= TAILQ_HEAD_INITIALIZER(_wslv.sc_L_unsubs),
+	.sc_L_pend_list		= TAILQ_HEAD_INITIALIZER(_wslv.sc_L_pend_list),
+
+	.sc_last_list		= TAILQ_HEAD_INITIALIZER(_wslv.sc_last_list),
 };
 struct wslv_softc *sc = &_wslv;
 
+static inline void
+wslv_wakeup(struct wslv_softc *sc)
+{
+	sc->sc_metrics.m_wakeups++;
+}
+
 static int		wslv_open(struct wslv_softc *, const char *,
 			    const char **);
 
@@ -238,6 +554,8 @@ static void		wslv_wake(struct wslv_softc *);
 
 static void		wslv_lv_flush(lv_display_t *, const lv_area_t *,
 			    uint8_t *);
+static void		wslv_lv_render_start(lv_event_t *);
+static void		wslv_lv_render_ready(lv_event_t *);
 
 static int		wslv_svideo(struct wslv_softc *, int);
 static int		wslv_wsfb_svideo(struct wslv_softc *, int);
@@ -248,6 +566,9 @@ static void		wslv_probe_brightness(struct wslv_softc *);
 
 static void		wslv_mqtt_init(struct wslv_softc *);
 static void		wslv_mqtt_connect(struct wslv_softc *);
+static int		wslv_mqtt_publish(struct wslv_softc *,
+			    const char *, size_t, const char *, size_t,
+			    enum mqtt_qos, int);
 
 static void		wslv_mqtt_tele(struct wslv_softc *);
 static void		wslv_mqtt_tele_period(int, short, void *);
@@ -261,9 +582,23 @@ static void		wslv_lua_mqtt_suback(struct wslv_softc *, void *,
 static void		wslv_lua_mqtt_unsuback(struct wslv_softc *, void *);
 static void		wslv_lua_mqtt_message(struct wslv_softc *,
 			    char *, size_t, char *, size_t, int);
+static void		wslv_lua_mqtt_connected(struct wslv_softc *);
+static void		wslv_lua_mqtt_disconnected(struct wslv_softc *);
+static int		wslv_pub(struct wslv_softc *, const char *, size_t,
+			    const char *, size_t, enum mqtt_qos, int);
+static void		wslv_pub_drained(struct wslv_softc *);
+static void		wslv_pub_policies_clear(struct wslv_softc *);
+
+static enum mqtt_qos	wslv_lua_checkqos(lua_State *, int);
+static const char	*wslv_lua_payload(lua_State *, int, size_t *);
+
+static void		wslv_lua_mqtt_pend(struct wslv_softc *,
+			    char *, size_t, char *, size_t, int);
+static void		wslv_lua_mqtt_deliver(struct wslv_softc *);
+static void		wslv_lua_mqtt_pend_clear(struct wslv_softc *);
 
 static int		wslv_luaopen(struct wslv_softc *, lua_State *);
-static void		wslv_lua_cmnd(struct wslv_softc *,
+static void		wslv_lua_cmnd(struct wslv_softc *, int,
 			    const char *, size_t, const char *, size_t);
 static void		wslv_lua_clocktick(int, short, void *);
 
@@ -273,8 +608,8 @@ usage(void)
 	extern char *__progname;
 
 	fprintf(stderr,
-	    "usage: %s [-46] [-d devname] [-i blanktime] [-p port]\n"
-	    "\t[-M wsmouse] [-W wsdiplay] -h mqtthost -l script.lua\n",
+	    "usage: %s [-46] [-C cachedir] [-d devname] [-i blanktime]\n"
+	    "\t[-p port] [-M wsmouse] [-W wsdiplay] -h mqtthost -l script.lua\n",
 	    __progname);
 
 	exit(0);
@@ -294,7 +629,7 @@ main(int argc, char *argv[])
 
 	TAILQ_INIT(&sc->sc_pointer_list);
 
-	while ((ch = getopt(argc, argv, "46d:h:i:K:l:M:p:rW:")) != -1) {
+	while ((ch = getopt(argc, argv, "46C:d:h:i:K:l:M:p:rW:")) != -1) {
 		switch (ch) {
 		case '4':
 			sc->sc_mqtt_family = AF_INET;
@@ -302,6 +637,9 @@ main(int argc, char *argv[])
 		case '6':
 			sc->sc_mqtt_family = AF_INET6;
 			break;
+		case 'C':
+			sc->sc_L_cachedir = optarg;
+			break;
 		case 'd':
 			sc->sc_mqtt_device = optarg;
 			break;
@@ -434,6 +772,10 @@ main(int argc, char *argv[])
 	}
 
 	lv_display_set_user_data(sc->sc_lv_display, sc);
+	lv_display_add_event_cb(sc->sc_lv_display, wslv_lv_render_start,
+	    LV_EVENT_RENDER_START, sc);
+	lv_display_add_event_cb(sc->sc_lv_display, wslv_lv_render_ready,
+	    LV_EVENT_RENDER_READY, sc);
 
 	fprintf(stderr,
 	    "%s, %u * %u, %d bit mmap %p+%zu\n",
@@ -664,6 +1006,8 @@ wslv_pointer_event(int fd, short revents, void *arg)
 	ssize_t rv;
 	size_t i, n;
 
+	wslv_wakeup(wp->wp_wslv);
+
 	rv = read(fd, wsevts, sizeof(wsevts));
 	if (rv == -1) {
 		warn("%s", __func__);
@@ -754,6 +1098,8 @@ wslv_ws_rd(int fd, short revents, void *arg)
 	ssize_t rv;
 	size_t i, n;
 
+	wslv_wakeup(sc);
+
 	rv = read(fd, events, sizeof(events));
 	if (rv == -1) {
 		warn("%s", __func__);
@@ -773,8 +1119,10 @@ wslv_tick(int nil, short events, void *arg)
 {
 	static const struct timeval rate = { 0, 1000000 / WSLV_REFR_PERIOD };
 
+	wslv_wakeup(sc);
 	evtimer_add(&sc->sc_tick, &rate);
 
+	wslv_lua_mqtt_deliver(sc);
 	lv_timer_handler();
 }
 
@@ -806,6 +1154,8 @@ wslv_idle_ev(int nil, short events, void *arg)
 
 	assert(sc->sc_idle <= WSLV_IDLE_STATE_ASLEEP);
 
+	wslv_wakeup(sc);
+
 	switch (sc->sc_idle++) {
 	case WSLV_IDLE_STATE_AWAKE: /* getting dozy */
 		evtimer_add(&sc->sc_idle_ev, &sc->sc_idle_time);
@@ -964,6 +1314,34 @@ wslv_lv_flush(lv_display_t *display, const lv_area_t *area,
 	lv_display_flush_ready(display);
 }
 
+static void
+wslv_lv_render_start(lv_event_t *e)
+{
+	struct wslv_softc *sc = lv_event_get_user_data(e);
+	struct wslv_metrics *m = &sc->sc_metrics;
+
+	m->m_frame_start = wslv_ms();
+	m->m_frame_busy = 1;
+}
+
+static void
+wslv_lv_render_ready(lv_event_t *e)
+{
+	struct wslv_softc *sc = lv_event_get_user_data(e);
+	struct wslv_metrics *m = &sc->sc_metrics;
+	unsigned int ms;
+
+	if (!m->m_frame_busy)
+		return;
+	m->m_frame_busy = 0;
+
+	ms = wslv_ms() - m->m_frame_start;
+	if (ms > m->m_frame_max)
+		m->m_frame_max = ms;
+	m->m_frame_hist[MIN(ms, WSLV_FRAME_BUCKETS - 1)]++;
+	m->m_frames++;
+}
+
 static void
 wslv_probe_brightness(struct wslv_softc *sc)
 {
@@ -978,16 +1356,34 @@ wslv_probe_brightness(struct wslv_softc *sc)
 }
 
 /* */
-struct wslv_mqtt_cmnd;
-static const struct wslv_mqtt_cmnd *
-		wslv_mqtt_cmnd(const char *, size_t);
+static void	wslv_cmnds_init(struct wslv_softc *);
+static struct wslv_cmnd *
+		wslv_cmnd_lookup(struct wslv_softc *, const char *, size_t);
+static struct wslv_cmnd *
+		wslv_cmnd_insert(struct wslv_softc *, const char *, size_t,
+		    wslv_cmnd_builtin, int);
+static void	wslv_cmnd_remove(struct wslv_softc *, struct wslv_cmnd *);
 
 /* wrappers */
 
 static void	wslv_mqtt_rd(int, short, void *);
 static void	wslv_mqtt_wr(int, short, void *);
+static int	wslv_mqtt_flush(struct wslv_softc *);
 static void	wslv_mqtt_to(int, short, void *);
 
+static void	wslv_mqtt_start(struct wslv_softc *);
+static void	wslv_mqtt_resolved(struct asr_result *, void *);
+static void	wslv_mqtt_dial_next(struct wslv_softc *);
+static void	wslv_mqtt_dial_ev(int, short, void *);
+static void	wslv_mqtt_dialed(int, short, void *);
+static void	wslv_mqtt_dial_abort(struct wslv_softc *);
+static void	wslv_mqtt_connto(int, short, void *);
+static void	wslv_mqtt_established(struct wslv_softc *, int);
+static void	wslv_mqtt_fail(struct wslv_softc *);
+static void	wslv_mqtt_backoff(struct wslv_softc *);
+static void	wslv_mqtt_backoff_ev(int, short, void *);
+static int	wslv_mqtt_flush_queue(struct wslv_softc *);
+
 /* callbacks */
 
 static void	wslv_mqtt_want_output(struct mqtt_conn *);
@@ -1048,73 +1444,62 @@ wslv_mqtt_check_topic(const char *t, const char **errstr)
 	return (0);
 }
 
-static int
-wslv_mqtt_socket(struct wslv_softc *sc)
+/*
+ * happy eyeballs (rfc 8305) style ordering of the resolved addresses,
+ * ie, alternate between address families starting with whatever the
+ * resolver preferred.
+ */
+static struct addrinfo *
+wslv_mqtt_interleave(struct addrinfo *res0)
 {
-	struct addrinfo hints, *res, *res0;
-	int error, serrno;
-	int s;
-	const char *cause = NULL;
-
-	memset(&hints, 0, sizeof(hints));
-	hints.ai_family = sc->sc_mqtt_family;
-	hints.ai_socktype = SOCK_STREAM;
-
-	error = getaddrinfo(sc->sc_mqtt_host, sc->sc_mqtt_serv, &hints, &res0);
-	if (error) {
-		errx(1, "MQTT host %s port %s: %s",
-		    sc->sc_mqtt_host, sc->sc_mqtt_serv,
-		    gai_strerror(error));
+	struct addrinfo *a = NULL, **ap = &a;
+	struct addrinfo *b = NULL, **bp = &b;
+	struct addrinfo *head = NULL, **hp = &head;
+	struct addrinfo *res, *next;
+	int family = res0->ai_family;
+
+	for (res = res0; res != NULL; res = next) {
+		next = res->ai_next;
+		res->ai_next = NULL;
+
+		if (res->ai_family == family) {
+			*ap = res;
+			ap = &res->ai_next;
+		} else {
+			*bp = res;
+			bp = &res->ai_next;
+		}
 	}
 
-	s = -1;
-	for (res = res0; res != NULL; res = res->ai_next) {
-		s = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
-		if (s == -1) {
-			serrno = errno;
-			cause = "socket";
-			continue;
+	while (a != NULL || b != NULL) {
+		if (a != NULL) {
+			next = a->ai_next;
+			*hp = a;
+			hp = &a->ai_next;
+			a = next;
 		}
-
-		if (connect(s, res->ai_addr, res->ai_addrlen) == -1) {
-			serrno = errno;
-			cause = "connect";
-			close(s);
-			s = -1;
-			continue;
+		if (b != NULL) {
+			next = b->ai_next;
+			*hp = b;
+			hp = &b->ai_next;
+			b = next;
 		}
-
-		break;  /* okay we got one */
 	}
+	*hp = NULL;
 
-	if (s == -1) {
-		errc(1, serrno, "MQTT host %s port %s %s",
-		    sc->sc_mqtt_host, sc->sc_mqtt_serv, cause);
-	}
-
-	sc->sc_mqtt_res0 = res0;
-
-	return (s);
+	return (head);
 }
 
 static void
 wslv_mqtt_init(struct wslv_softc *sc)
 {
-	int nbio = 1;
 	char *topic;
 	int rv;
-	int s;
-	FILE *f;
 	const char *errstr;
 
 	if (wslv_mqtt_check_topic(sc->sc_mqtt_device, &errstr) == -1)
 		errx(1, "mqtt device topic: %s", errstr);
 
-	s = wslv_mqtt_socket(sc);
-
-	if (ioctl(s, FIONBIO, &nbio) == -1)
-		err(1, "set mqtt nbio");
-
 	rv = asprintf(&topic, "tele/%s/LWT", sc->sc_mqtt_device);
 	if (rv == -1)
 		errx(1, "mqtt lwt topic printf error");
@@ -1122,480 +1507,2705 @@ wslv_mqtt_init(struct wslv_softc *sc)
 	sc->sc_mqtt_will_topic = topic;
 	sc->sc_mqtt_will_topic_len = rv;
 
-	sc->sc_mqtt_conn = mqtt_conn_create(&wslv_mqtt_settings, sc);
-	if (sc->sc_mqtt_conn == NULL)
-		errx(1, "unable to create mqtt connection");
-
-	sc->sc_mqtt_fd = s;
+	wslv_cmnds_init(sc);
 }
 
 static void
 wslv_mqtt_connect(struct wslv_softc *sc)
 {
-	static const char offline[] = "Offline";
-	struct mqtt_conn_settings mcs = {
-		.clean_session = 1,
-		.keep_alive = 30,
-
-		.clientid = sc->sc_mqtt_device,
-		.clientid_len = strlen(sc->sc_mqtt_device),
-
-		.will_topic = sc->sc_mqtt_will_topic,
-		.will_topic_len = sc->sc_mqtt_will_topic_len,
-		.will_payload = offline,
-		.will_payload_len = sizeof(offline) - 1,
-		.will_retain = MQTT_RETAIN,
-	};
-	struct mqtt_conn *mc = sc->sc_mqtt_conn;
-
-	event_set(&sc->sc_mqtt_ev_rd, sc->sc_mqtt_fd, EV_READ|EV_PERSIST,
-	    wslv_mqtt_rd, sc);
-	event_set(&sc->sc_mqtt_ev_wr, sc->sc_mqtt_fd, EV_WRITE,
-	    wslv_mqtt_wr, sc);
 	evtimer_set(&sc->sc_mqtt_ev_to, wslv_mqtt_to, sc);
+	evtimer_set(&sc->sc_mqtt_ev_backoff, wslv_mqtt_backoff_ev, sc);
+	evtimer_set(&sc->sc_mqtt_ev_dial, wslv_mqtt_dial_ev, sc);
+	evtimer_set(&sc->sc_mqtt_ev_connto, wslv_mqtt_connto, sc);
+	evtimer_set(&sc->sc_mqtt_tele_period, wslv_mqtt_tele_period, sc);
 
-	if (mqtt_connect(mc, &mcs) == -1)
-		errx(1, "failed to connect mqtt");
-
-	event_add(&sc->sc_mqtt_ev_rd, NULL);
+	sc->sc_mqtt_wbuf.wb_buf = malloc(WSLV_MQTT_WBUF_SIZE);
+	if (sc->sc_mqtt_wbuf.wb_buf == NULL)
+		err(1, "mqtt output buffer");
+	sc->sc_tele_buf = malloc(WSLV_TELE_BUFLEN);
+	if (sc->sc_tele_buf == NULL)
+		err(1, "mqtt tele buffer");
+	sc->sc_metrics.m_period_start = wslv_ms();
 
-	evtimer_set(&sc->sc_mqtt_tele_period, wslv_mqtt_tele_period, sc);
+	wslv_mqtt_start(sc);
 }
 
-void
-wslv_mqtt_rd(int fd, short events, void *arg)
+/*
+ * connecting to the broker happens in the background so the ui can
+ * start while the name is resolved and the tcp handshakes complete.
+ */
+static void
+wslv_mqtt_start(struct wslv_softc *sc)
 {
-	struct wslv_softc *sc = arg;
-	struct mqtt_conn *mc = sc->sc_mqtt_conn;
-	char buf[8192];
-	ssize_t rv;
+	static const struct timeval connto = { WSLV_MQTT_CONNECT_TIMEOUT, 0 };
+	struct addrinfo hints;
+	struct asr_query *q;
 
-	rv = read(fd, buf, sizeof(buf));
-	switch (rv) {
-	case -1:
-		switch (errno) {
-		case EAGAIN:
-		case EINTR:
-			return;
-		default:
-			break;
-		}
-		err(1, "%s", __func__);
-		/* NOTREACHED */
-	case 0:
-		mqtt_disconnect(mc);
-		mqtt_conn_destroy(mc);
-		errx(1, "disconnected");
-		/* NOTREACHED */
-	default:
-		break;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = sc->sc_mqtt_family;
+	hints.ai_socktype = SOCK_STREAM;
+
+	q = getaddrinfo_async(sc->sc_mqtt_host, sc->sc_mqtt_serv,
+	    &hints, NULL);
+	if (q == NULL) {
+		warn("MQTT host %s port %s resolve",
+		    sc->sc_mqtt_host, sc->sc_mqtt_serv);
+		wslv_mqtt_backoff(sc);
+		return;
 	}
 
-	mqtt_input(mc, buf, rv);
+	sc->sc_mqtt_state = WSLV_MQTT_S_RESOLVING;
+	sc->sc_mqtt_asr = event_asr_run(q, wslv_mqtt_resolved, sc);
+
+	evtimer_add(&sc->sc_mqtt_ev_connto, &connto);
 }
 
-void
-wslv_mqtt_wr(int fd, short events, void *arg)
+static void
+wslv_mqtt_resolved(struct asr_result *ar, void *arg)
 {
 	struct wslv_softc *sc = arg;
-	struct mqtt_conn *mc = sc->sc_mqtt_conn;
 
-	mqtt_output(mc);
+	sc->sc_mqtt_asr = NULL;
+
+	if (ar->ar_gai_errno != 0) {
+		warnx("MQTT host %s port %s: %s",
+		    sc->sc_mqtt_host, sc->sc_mqtt_serv,
+		    gai_strerror(ar->ar_gai_errno));
+		wslv_mqtt_fail(sc);
+		return;
+	}
+
+	sc->sc_mqtt_res0 = wslv_mqtt_interleave(ar->ar_addrinfo);
+	sc->sc_mqtt_res = sc->sc_mqtt_res0;
+	sc->sc_mqtt_state = WSLV_MQTT_S_DIALING;
+
+	wslv_mqtt_dial_next(sc);
 }
 
+/*
+ * start a connection attempt to the next address. if it doesnt
+ * complete within WSLV_MQTT_DIAL_DELAY another attempt is started
+ * alongside it, and the first one to complete wins.
+ */
 static void
-wslv_mqtt_want_output(struct mqtt_conn *mc)
+wslv_mqtt_dial_next(struct wslv_softc *sc)
 {
-	struct wslv_softc *sc = mqtt_cookie(mc);
+	static const struct timeval delay = { 0, WSLV_MQTT_DIAL_DELAY * 1000 };
+	struct wslv_mqtt_dial *d;
+	struct addrinfo *res;
+	int s;
 
-	event_add(&sc->sc_mqtt_ev_wr, NULL);
-}
+	while ((res = sc->sc_mqtt_res) != NULL) {
+		sc->sc_mqtt_res = res->ai_next;
 
-static ssize_t
-wslv_mqtt_output(struct mqtt_conn *mc, const void *buf, size_t len)
-{
-	struct wslv_softc *sc = mqtt_cookie(mc);
-	int fd = EVENT_FD(&sc->sc_mqtt_ev_wr);
-	ssize_t rv;
+		s = socket(res->ai_family, res->ai_socktype | SOCK_NONBLOCK,
+		    res->ai_protocol);
+		if (s == -1) {
+			warn("MQTT host %s port %s socket",
+			    sc->sc_mqtt_host, sc->sc_mqtt_serv);
+			continue;
+		}
 
-	rv = write(fd, buf, len);
-	if (rv == -1) {
-		switch (errno) {
-		case EAGAIN:
-		case EINTR:
-			return (0);
-		default:
-			break;
+		if (connect(s, res->ai_addr, res->ai_addrlen) == -1 &&
+		    errno != EINPROGRESS) {
+			warn("MQTT host %s port %s connect",
+			    sc->sc_mqtt_host, sc->sc_mqtt_serv);
+			close(s);
+			continue;
 		}
 
-		err(1, "%s", __func__);
-		/* XXX reconnect */
+		d = malloc(sizeof(*d));
+		if (d == NULL) {
+			warn("MQTT dial alloc");
+			close(s);
+			continue;
+		}
+
+		d->d_sc = sc;
+		d->d_fd = s;
+		event_set(&d->d_ev, s, EV_WRITE, wslv_mqtt_dialed, d);
+		event_add(&d->d_ev, NULL);
+		TAILQ_INSERT_TAIL(&sc->sc_mqtt_dials, d, d_entry);
+
+		if (sc->sc_mqtt_res != NULL)
+			evtimer_add(&sc->sc_mqtt_ev_dial, &delay);
+
+		return;
 	}
 
-	return (rv);
+	if (TAILQ_EMPTY(&sc->sc_mqtt_dials)) {
+		warnx("MQTT host %s port %s: no addresses left to try",
+		    sc->sc_mqtt_host, sc->sc_mqtt_serv);
+		wslv_mqtt_fail(sc);
+	}
 }
 
 static void
-wslv_mqtt_to(int nil, short events, void *arg)
+wslv_mqtt_dial_ev(int nil, short events, void *arg)
 {
 	struct wslv_softc *sc = arg;
-	struct mqtt_conn *mc = sc->sc_mqtt_conn;
 
-	mqtt_timeout(mc);
+	wslv_mqtt_dial_next(sc);
 }
 
 static void
-wslv_mqtt_want_timeout(struct mqtt_conn *mc, const struct timespec *ts)
+wslv_mqtt_dialed(int fd, short events, void *arg)
 {
-	struct wslv_softc *sc = mqtt_cookie(mc);
-	struct timeval tv;
-
-	TIMESPEC_TO_TIMEVAL(&tv, ts);
+	struct wslv_mqtt_dial *d = arg;
+	struct wslv_softc *sc = d->d_sc;
+	socklen_t len = sizeof(int);
+	int error;
+
+	TAILQ_REMOVE(&sc->sc_mqtt_dials, d, d_entry);
+	free(d);
+
+	if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) == -1)
+		error = errno;
+	if (error != 0) {
+		warnc(error, "MQTT host %s port %s connect",
+		    sc->sc_mqtt_host, sc->sc_mqtt_serv);
+		close(fd);
+
+		/* dont wait for the timer, try the next one now */
+		evtimer_del(&sc->sc_mqtt_ev_dial);
+		wslv_mqtt_dial_next(sc);
+		return;
+	}
 
-	event_add(&sc->sc_mqtt_ev_to, &tv);
+	wslv_mqtt_dial_abort(sc);
+	wslv_mqtt_established(sc, fd);
 }
 
-static const char prefix_cmnd[] = "cmnd";
-#define prefix_cmnd_len (sizeof(prefix_cmnd) - 1)
-
 static void
-wslv_mqtt_on_connect(struct mqtt_conn *mc)
+wslv_mqtt_dial_abort(struct wslv_softc *sc)
 {
-	struct wslv_softc *sc = mqtt_cookie(mc);
-	char filter[128];
-	int rv;
+	struct wslv_mqtt_dial *d;
 
-	rv = snprintf(filter, sizeof(filter), "%s/%s/#",
-	    prefix_cmnd, sc->sc_mqtt_device);
-	if (rv == -1 || (size_t)rv >= sizeof(filter))
-		errx(1, "mqtt subscribe filter");
+	if (sc->sc_mqtt_asr != NULL) {
+		event_asr_abort(sc->sc_mqtt_asr);
+		sc->sc_mqtt_asr = NULL;
+	}
 
-	if (mqtt_subscribe(mc, NULL, filter, rv, MQTT_QOS0) == -1)
-		errx(1, "mqtt subscribe %s failed", filter);
+	evtimer_del(&sc->sc_mqtt_ev_dial);
+	while ((d = TAILQ_FIRST(&sc->sc_mqtt_dials)) != NULL) {
+		TAILQ_REMOVE(&sc->sc_mqtt_dials, d, d_entry);
+		event_del(&d->d_ev);
+		close(d->d_fd);
+		free(d);
+	}
+
+	if (sc->sc_mqtt_res0 != NULL) {
+		freeaddrinfo(sc->sc_mqtt_res0);
+		sc->sc_mqtt_res0 = NULL;
+		sc->sc_mqtt_res = NULL;
+	}
 }
 
 static void
-wslv_mqtt_on_suback(struct mqtt_conn *mc, void *cookie,
-    const uint8_t *rcodes, size_t nrcodes)
+wslv_mqtt_connto(int nil, short events, void *arg)
 {
-	struct wslv_softc *sc = mqtt_cookie(mc);
-	static const char online[] = "Online";
-
-	if (cookie != NULL) {
-		wslv_lua_mqtt_suback(sc, cookie, rcodes, nrcodes);
-		return;
-	}
-
-	if (mqtt_publish(mc,
-	    sc->sc_mqtt_will_topic, sc->sc_mqtt_will_topic_len,
-	    online, sizeof(online) - 1, MQTT_QOS0, MQTT_RETAIN) == -1)
-		errx(1, "mqtt publish %s %s", sc->sc_mqtt_will_topic, online);
+	struct wslv_softc *sc = arg;
 
-	wslv_mqtt_tele_period(0, 0, sc);
+	warnx("MQTT host %s port %s: connect timeout",
+	    sc->sc_mqtt_host, sc->sc_mqtt_serv);
+	wslv_mqtt_fail(sc);
 }
 
 static void
-wslv_mqtt_on_unsuback(struct mqtt_conn *mc, void *cookie)
+wslv_mqtt_established(struct wslv_softc *sc, int s)
 {
-	struct wslv_softc *sc = mqtt_cookie(mc);
+	static const char offline[] = "Offline";
+	struct mqtt_conn_settings mcs = {
+		.clean_session = 1,
+		.keep_alive = 30,
 
-	if (cookie != NULL) {
+		.clientid = sc->sc_mqtt_device,
+		.clientid_len = strlen(sc->sc_mqtt_device),
+
+		.will_topic = sc->sc_mqtt_will_topic,
+		.will_topic_len = sc->sc_mqtt_will_topic_len,
+		.will_payload = offline,
+		.will_payload_len = sizeof(offline) - 1,
+		.will_retain = MQTT_RETAIN,
+	};
+	struct mqtt_conn *mc;
+
+	sc->sc_mqtt_fd = s;
+
+	mc = mqtt_conn_create(&wslv_mqtt_settings, sc);
+	if (mc == NULL) {
+		warnx("unable to create mqtt connection");
+		wslv_mqtt_fail(sc);
+		return;
+	}
+
+	sc->sc_mqtt_conn = mc;
+	sc->sc_mqtt_state = WSLV_MQTT_S_CONNECTING;
+
+	event_set(&sc->sc_mqtt_ev_rd, s, EV_READ|EV_PERSIST,
+	    wslv_mqtt_rd, sc);
+	event_set(&sc->sc_mqtt_ev_wr, s, EV_WRITE,
+	    wslv_mqtt_wr, sc);
+
+	if (mqtt_connect(mc, &mcs) == -1) {
+		warnx("failed to connect mqtt");
+		wslv_mqtt_fail(sc);
+		return;
+	}
+
+	event_add(&sc->sc_mqtt_ev_rd, NULL);
+}
+
+/*
+ * tear down the socket and schedule another connection attempt.
+ * this can be called from inside amqtt callbacks, so the mqtt_conn
+ * itself is left for wslv_mqtt_backoff_ev to destroy.
+ */
+static void
+wslv_mqtt_fail(struct wslv_softc *sc)
+{
+	if (sc->sc_mqtt_state == WSLV_MQTT_S_IDLE)
+		return;
+
+	sc->sc_mqtt_state = WSLV_MQTT_S_IDLE;
+
+	wslv_mqtt_dial_abort(sc);
+	evtimer_del(&sc->sc_mqtt_ev_connto);
+
+	if (sc->sc_mqtt_fd != -1) {
+		event_del(&sc->sc_mqtt_ev_rd);
+		event_del(&sc->sc_mqtt_ev_wr);
+
+		close(sc->sc_mqtt_fd);
+		sc->sc_mqtt_fd = -1;
+	}
+	sc->sc_mqtt_wbuf.wb_prod = sc->sc_mqtt_wbuf.wb_cons = 0;
+	sc->sc_mqtt_wbuf.wb_gen++;
+	evtimer_del(&sc->sc_mqtt_ev_to);
+	evtimer_del(&sc->sc_mqtt_tele_period);
+
+	wslv_lua_mqtt_disconnected(sc);
+
+	wslv_mqtt_backoff(sc);
+}
+
+static void
+wslv_mqtt_backoff(struct wslv_softc *sc)
+{
+	struct timeval tv;
+	unsigned int ms;
+
+	ms = WSLV_MQTT_BACKOFF_MIN << sc->sc_mqtt_backoff;
+	if (ms >= WSLV_MQTT_BACKOFF_MAX)
+		ms = WSLV_MQTT_BACKOFF_MAX;
+	else
+		sc->sc_mqtt_backoff++;
+
+	/* spread the panels out so they dont all hit the broker at once */
+	ms = (ms / 2) + arc4random_uniform((ms / 2) + 1);
+
+	tv.tv_sec = ms / 1000;
+	tv.tv_usec = (ms % 1000) * 1000;
+
+	evtimer_add(&sc->sc_mqtt_ev_backoff, &tv);
+}
+
+static void
+wslv_mqtt_backoff_ev(int nil, short events, void *arg)
+{
+	struct wslv_softc *sc = arg;
+
+	/*
+	 * this throws away amqtt's inflight qos 1 and 2 state. amqtt
+	 * doesn't say when a publish is acked, so wslv can't keep
+	 * copies to replay, and the clean session means the broker
+	 * drops its side too. qos 1 and 2 don't survive a reconnect.
+	 */
+	if (sc->sc_mqtt_conn != NULL) {
+		mqtt_conn_destroy(sc->sc_mqtt_conn);
+		sc->sc_mqtt_conn = NULL;
+	}
+
+	sc->sc_mqtt_reconnects++;
+	wslv_mqtt_start(sc);
+}
+
+void
+wslv_mqtt_rd(int fd, short events, void *arg)
+{
+	struct wslv_softc *sc = arg;
+	struct mqtt_conn *mc = sc->sc_mqtt_conn;
+	size_t budget = WSLV_MQTT_RD_BUDGET;
+	uint8_t *buf;
+	size_t len;
+	ssize_t rv;
+
+	wslv_wakeup(sc);
+
+	/*
+	 * keep reading until the socket is drained so a burst of
+	 * retained messages is handled in one go, but give the rest
+	 * of the loop a turn if the broker keeps the socket busy.
+	 */
+	do {
+		if (sc->sc_mqtt_rbuf == NULL) {
+			sc->sc_mqtt_rbuf = malloc(WSLV_MQTT_RBUF_MIN);
+			if (sc->sc_mqtt_rbuf == NULL) {
+				warn("%s", __func__);
+				return;
+			}
+			sc->sc_mqtt_rbuf_len = WSLV_MQTT_RBUF_MIN;
+		}
+
+		buf = sc->sc_mqtt_rbuf;
+		len = MIN(sc->sc_mqtt_rbuf_len, budget);
+
+		rv = read(fd, buf, len);
+		switch (rv) {
+		case -1:
+			switch (errno) {
+			case EAGAIN:
+			case EINTR:
+				return;
+			default:
+				break;
+			}
+			warn("%s", __func__);
+			wslv_mqtt_fail(sc);
+			return;
+		case 0:
+			warnx("mqtt disconnected");
+			wslv_mqtt_fail(sc);
+			return;
+		default:
+			break;
+		}
+
+		sc->sc_metrics.m_mqtt_rd_bytes += rv;
+		mqtt_input(mc, buf, rv);
+		if (sc->sc_mqtt_state == WSLV_MQTT_S_IDLE)
+			return;
+
+		budget -= rv;
+
+		/* a full read suggests there's more where that came from */
+		if ((size_t)rv == sc->sc_mqtt_rbuf_len &&
+		    sc->sc_mqtt_rbuf_len < WSLV_MQTT_RBUF_MAX) {
+			buf = realloc(sc->sc_mqtt_rbuf,
+			    sc->sc_mqtt_rbuf_len * 2);
+			if (buf != NULL) {
+				sc->sc_mqtt_rbuf = buf;
+				sc->sc_mqtt_rbuf_len *= 2;
+			}
+		}
+	} while ((size_t)rv == len && budget > 0);
+}
+
+void
+wslv_mqtt_wr(int fd, short events, void *arg)
+{
+	struct wslv_softc *sc = arg;
+	struct mqtt_conn *mc = sc->sc_mqtt_conn;
+	struct wslv_mqtt_wbuf *wb = &sc->sc_mqtt_wbuf;
+
+	/*
+	 * everything amqtt produced since the last time the socket was
+	 * writable is gathered into the ring and goes out in one writev.
+	 * keep going while amqtt is only held back by ring space.
+	 */
+	wslv_wakeup(sc);
+	do {
+		wb->wb_full = 0;
+		mqtt_output(mc);
+		if (sc->sc_mqtt_state == WSLV_MQTT_S_IDLE)
+			return;
+
+		if (wslv_mqtt_flush(sc) == -1)
+			return;
+	} while (wb->wb_full && wb->wb_prod == wb->wb_cons);
+
+	if (wb->wb_prod != wb->wb_cons)
+		event_add(&sc->sc_mqtt_ev_wr, NULL);
+	else
+		wslv_pub_drained(sc);
+}
+
+static int
+wslv_mqtt_flush(struct wslv_softc *sc)
+{
+	struct wslv_mqtt_wbuf *wb = &sc->sc_mqtt_wbuf;
+	struct iovec iov[2];
+	size_t len, off, n;
+	int iovcnt = 1;
+	ssize_t rv;
+
+	len = wb->wb_prod - wb->wb_cons;
+	if (len == 0)
+		return (0);
+
+	off = wb->wb_cons & (WSLV_MQTT_WBUF_SIZE - 1);
+	n = MIN(len, WSLV_MQTT_WBUF_SIZE - off);
+
+	iov[0].iov_base = wb->wb_buf + off;
+	iov[0].iov_len = n;
+	if (n < len) {
+		iov[1].iov_base = wb->wb_buf;
+		iov[1].iov_len = len - n;
+		iovcnt = 2;
+	}
+
+	rv = writev(sc->sc_mqtt_fd, iov, iovcnt);
+	if (rv == -1) {
+		switch (errno) {
+		case EAGAIN:
+		case EINTR:
+			return (0);
+		default:
+			break;
+		}
+
+		warn("%s", __func__);
+		wslv_mqtt_fail(sc);
+		return (-1);
+	}
+
+	wb->wb_writes++;
+	wb->wb_bytes += rv;
+
+	wb->wb_cons += rv;
+	if (wb->wb_cons == wb->wb_prod) {
+		wb->wb_prod = wb->wb_cons = 0;
+		wb->wb_gen++;
+	}
+
+	return (0);
+}
+
+static void
+wslv_mqtt_want_output(struct mqtt_conn *mc)
+{
+	struct wslv_softc *sc = mqtt_cookie(mc);
+
+	if (sc->sc_mqtt_state == WSLV_MQTT_S_IDLE)
+		return;
+
+	event_add(&sc->sc_mqtt_ev_wr, NULL);
+}
+
+static ssize_t
+wslv_mqtt_output(struct mqtt_conn *mc, const void *buf, size_t len)
+{
+	struct wslv_softc *sc = mqtt_cookie(mc);
+	struct wslv_mqtt_wbuf *wb = &sc->sc_mqtt_wbuf;
+	size_t space, off, n;
+
+	if (sc->sc_mqtt_state == WSLV_MQTT_S_IDLE)
+		return (0);
+
+	space = WSLV_MQTT_WBUF_SIZE - (wb->wb_prod - wb->wb_cons);
+	if (len > space) {
+		len = space;
+		wb->wb_full = 1;
+		if (len == 0)
+			return (0);
+	}
+
+	off = wb->wb_prod & (WSLV_MQTT_WBUF_SIZE - 1);
+	n = MIN(len, WSLV_MQTT_WBUF_SIZE - off);
+	memcpy(wb->wb_buf + off, buf, n);
+	memcpy(wb->wb_buf, (const uint8_t *)buf + n, len - n);
+	wb->wb_prod += len;
+	wb->wb_pkts++;
+
+	/* the flush happens once the rest of this loop has run */
+	event_add(&sc->sc_mqtt_ev_wr, NULL);
+
+	return (len);
+}
+
+static void
+wslv_mqtt_to(int nil, short events, void *arg)
+{
+	struct wslv_softc *sc = arg;
+	struct mqtt_conn *mc = sc->sc_mqtt_conn;
+
+	wslv_wakeup(sc);
+	mqtt_timeout(mc);
+}
+
+static void
+wslv_mqtt_want_timeout(struct mqtt_conn *mc, const struct timespec *ts)
+{
+	struct wslv_softc *sc = mqtt_cookie(mc);
+	struct timeval tv;
+
+	if (sc->sc_mqtt_state == WSLV_MQTT_S_IDLE)
+		return;
+
+	TIMESPEC_TO_TIMEVAL(&tv, ts);
+
+	event_add(&sc->sc_mqtt_ev_to, &tv);
+}
+
+/*
+ * message buffer pools
+ *
+ * slabs are carved up into items of one size and never given back,
+ * so the pools only ever grow to the high water mark, and memory
+ * taken by a burst stays with the pools afterwards. anything too big
+ * for the largest class comes from malloc.
+ */
+
+static inline unsigned int
+wslv_pool_class(size_t size)
+{
+	unsigned int i = 0;
+
+	while (size > ((size_t)1 << (WSLV_POOL_MINSHIFT + i)))
+		i++;
+
+	return (i);
+}
+
+static void *
+wslv_pool_get(struct wslv_softc *sc, size_t size)
+{
+	struct wslv_pool *p;
+	struct wslv_pool_item *pi;
+	size_t isize, n;
+	char *slab;
+
+	if (size > WSLV_POOL_MAX) {
+		sc->sc_pool_big++;
+		return (malloc(size));
+	}
+
+	p = &sc->sc_pools[wslv_pool_class(size)];
+	if (p->p_free == NULL) {
+		isize = (size_t)1 << (WSLV_POOL_MINSHIFT +
+		    (p - sc->sc_pools));
+
+		slab = malloc(WSLV_POOL_SLAB);
+		if (slab == NULL)
+			return (NULL);
+		p->p_slabs++;
+
+		for (n = 0; n + isize <= WSLV_POOL_SLAB; n += isize) {
+			pi = (struct wslv_pool_item *)(slab + n);
+			pi->next = p->p_free;
+			p->p_free = pi;
+		}
+	}
+
+	pi = p->p_free;
+	p->p_free = pi->next;
+
+	if (++p->p_inuse > p->p_hwm)
+		p->p_hwm = p->p_inuse;
+
+	return (pi);
+}
+
+static void
+wslv_pool_put(struct wslv_softc *sc, void *ptr, size_t size)
+{
+	struct wslv_pool *p;
+	struct wslv_pool_item *pi = ptr;
+
+	if (ptr == NULL)
+		return;
+
+	if (size > WSLV_POOL_MAX) {
+		free(ptr);
+		return;
+	}
+
+	p = &sc->sc_pools[wslv_pool_class(size)];
+	pi->next = p->p_free;
+	p->p_free = pi;
+	p->p_inuse--;
+}
+
+/*
+ * publishes go straight to amqtt while the broker is connected,
+ * otherwise they are held in a bounded queue until it comes back.
+ * only the latest payload for a topic is kept in the queue.
+ */
+
+static inline size_t
+wslv_mqtt_msg_size(const struct wslv_mqtt_msg *m)
+{
+	return (sizeof(*m) + m->topic_len + m->payload_len);
+}
+
+static inline int
+wslv_mqtt_queue_full(unsigned int len, size_t bytes, size_t size)
+{
+	return (len >= WSLV_MQTT_QUEUE_MAX ||
+	    bytes + size > WSLV_MQTT_QUEUE_BYTES);
+}
+
+static void
+wslv_mqtt_dequeue(struct wslv_softc *sc, struct wslv_mqtt_msg *m)
+{
+	TAILQ_REMOVE(&sc->sc_mqtt_queue, m, entry);
+	sc->sc_mqtt_queue_len--;
+	sc->sc_mqtt_queue_bytes -= wslv_mqtt_msg_size(m);
+
+	wslv_pool_put(sc, m->payload, m->payload_len);
+	wslv_pool_put(sc, m, sizeof(*m) + m->topic_len);
+}
+
+static int
+wslv_mqtt_enqueue(struct wslv_softc *sc, const char *topic, size_t topic_len,
+    const char *payload, size_t payload_len, enum mqtt_qos qos, int retain)
+{
+	struct wslv_mqtt_msg *m, *nm;
+	size_t size = sizeof(*m) + topic_len + payload_len;
+	unsigned int len;
+	size_t bytes;
+	char *p = NULL;
+
+	if (size > WSLV_MQTT_QUEUE_BYTES) {
+		sc->sc_mqtt_queue_drops++;
+		return (-1);
+	}
+
+	if (payload_len > 0) {
+		p = wslv_pool_get(sc, payload_len);
+		if (p == NULL) {
+			sc->sc_mqtt_queue_drops++;
+			return (-1);
+		}
+		memcpy(p, payload, payload_len);
+	}
+
+	/* every qos 1 and 2 message has to be delivered */
+	TAILQ_FOREACH(m, &sc->sc_mqtt_queue, entry) {
+		if (qos == MQTT_QOS0 && m->qos == MQTT_QOS0 &&
+		    m->topic_len == topic_len &&
+		    memcmp(m->topic, topic, topic_len) == 0) {
+			sc->sc_mqtt_queue_bytes -= m->payload_len;
+			wslv_pool_put(sc, m->payload, m->payload_len);
+
+			m->payload = p;
+			m->payload_len = payload_len;
+			m->qos = qos;
+			m->retain = retain;
+			sc->sc_mqtt_queue_bytes += payload_len;
+
+			sc->sc_mqtt_queue_drops++;
+			return (0);
+		}
+	}
+
+	if (wslv_mqtt_queue_full(sc->sc_mqtt_queue_len,
+	    sc->sc_mqtt_queue_bytes, size)) {
+		/* only qos 0 messages can be thrown away to make room */
+		len = sc->sc_mqtt_queue_len;
+		bytes = sc->sc_mqtt_queue_bytes;
+		TAILQ_FOREACH(m, &sc->sc_mqtt_queue, entry) {
+			if (m->qos == MQTT_QOS0) {
+				len--;
+				bytes -= wslv_mqtt_msg_size(m);
+			}
+		}
+
+		/* refuse this one rather than lose a qos 1 or 2 message */
+		if (wslv_mqtt_queue_full(len, bytes, size)) {
+			wslv_pool_put(sc, p, payload_len);
+			sc->sc_mqtt_queue_drops++;
+			return (-1);
+		}
+
+		/* throw away the oldest qos 0 messages */
+		TAILQ_FOREACH_SAFE(m, &sc->sc_mqtt_queue, entry, nm) {
+			if (!wslv_mqtt_queue_full(sc->sc_mqtt_queue_len,
+			    sc->sc_mqtt_queue_bytes, size))
+				break;
+			if (m->qos != MQTT_QOS0)
+				continue;
+
+			wslv_mqtt_dequeue(sc, m);
+			sc->sc_mqtt_queue_drops++;
+		}
+	}
+
+	m = wslv_pool_get(sc, sizeof(*m) + topic_len);
+	if (m == NULL) {
+		wslv_pool_put(sc, p, payload_len);
+		sc->sc_mqtt_queue_drops++;
+		return (-1);
+	}
+
+	m->topic = (char *)(m + 1);
+	memcpy(m->topic, topic, topic_len);
+	m->topic_len = topic_len;
+	m->payload = p;
+	m->payload_len = payload_len;
+	m->qos = qos;
+	m->retain = retain;
+
+	TAILQ_INSERT_TAIL(&sc->sc_mqtt_queue, m, entry);
+	sc->sc_mqtt_queue_len++;
+	sc->sc_mqtt_queue_bytes += size;
+
+	return (0);
+}
+
+/*
+ * the queue is only drained here when the connection comes up, so
+ * a publish that fails is treated like losing the connection. the
+ * rest of the queue is then sent once wslv has reconnected.
+ */
+static int
+wslv_mqtt_flush_queue(struct wslv_softc *sc)
+{
+	struct mqtt_conn *mc = sc->sc_mqtt_conn;
+	struct wslv_mqtt_msg *m;
+
+	while ((m = TAILQ_FIRST(&sc->sc_mqtt_queue)) != NULL) {
+		if (mqtt_publish(mc, m->topic, m->topic_len,
+		    m->payload, m->payload_len, m->qos, m->retain) == -1) {
+			warnx("mqtt publish %.*s", (int)m->topic_len,
+			    m->topic);
+			wslv_mqtt_fail(sc);
+			return (-1);
+		}
+
+		wslv_mqtt_dequeue(sc, m);
+	}
+
+	return (0);
+}
+
+static int
+wslv_mqtt_publish(struct wslv_softc *sc, const char *topic, size_t topic_len,
+    const char *payload, size_t payload_len, enum mqtt_qos qos, int retain)
+{
+	int fail = 0;
+	int rv;
+
+	/* don't overtake messages still waiting in the queue */
+	if (sc->sc_mqtt_state == WSLV_MQTT_S_CONNECTED &&
+	    TAILQ_EMPTY(&sc->sc_mqtt_queue)) {
+		if (mqtt_publish(sc->sc_mqtt_conn, topic, topic_len,
+		    payload, payload_len, qos, retain) == 0)
+			return (0);
+
+		warnx("mqtt publish %.*s", (int)topic_len, topic);
+		fail = 1;
+	}
+
+	rv = wslv_mqtt_enqueue(sc, topic, topic_len,
+	    payload, payload_len, qos, retain);
+
+	/* reconnect so the queue actually gets sent */
+	if (fail)
+		wslv_mqtt_fail(sc);
+
+	return (rv);
+}
+
+static const char prefix_cmnd[] = "cmnd";
+#define prefix_cmnd_len (sizeof(prefix_cmnd) - 1)
+
+static void
+wslv_mqtt_on_connect(struct mqtt_conn *mc)
+{
+	struct wslv_softc *sc = mqtt_cookie(mc);
+	char filter[128];
+	int rv;
+
+	rv = snprintf(filter, sizeof(filter), "%s/%s/#",
+	    prefix_cmnd, sc->sc_mqtt_device);
+	if (rv == -1 || (size_t)rv >= sizeof(filter))
+		errx(1, "mqtt subscribe filter");
+
+	sc->sc_mqtt_state = WSLV_MQTT_S_CONNECTED;
+	sc->sc_mqtt_backoff = 0;
+	evtimer_del(&sc->sc_mqtt_ev_connto);
+
+	/* commands shouldn't get lost on a flaky link */
+	if (mqtt_subscribe(mc, NULL, filter, rv, MQTT_QOS1) == -1) {
+		warnx("mqtt subscribe %s failed", filter);
+		wslv_mqtt_fail(sc);
+		return;
+	}
+
+	wslv_lua_mqtt_connected(sc);
+}
+
+static void
+wslv_mqtt_on_suback(struct mqtt_conn *mc, void *cookie,
+    const uint8_t *rcodes, size_t nrcodes)
+{
+	struct wslv_softc *sc = mqtt_cookie(mc);
+	static const char online[] = "Online";
+
+	if (cookie != NULL) {
+		wslv_lua_mqtt_suback(sc, cookie, rcodes, nrcodes);
+		return;
+	}
+
+	/* empty the queue first so nothing published now is held up */
+	if (wslv_mqtt_flush_queue(sc) == -1)
+		return;
+
+	if (wslv_mqtt_publish(sc,
+	    sc->sc_mqtt_will_topic, sc->sc_mqtt_will_topic_len,
+	    online, sizeof(online) - 1, MQTT_QOS0, MQTT_RETAIN) == -1)
+		warnx("mqtt publish %s %s", sc->sc_mqtt_will_topic, online);
+
+	wslv_mqtt_tele_period(0, 0, sc);
+}
+
+static void
+wslv_mqtt_on_unsuback(struct mqtt_conn *mc, void *cookie)
+{
+	struct wslv_softc *sc = mqtt_cookie(mc);
+
+	if (cookie != NULL) {
 		wslv_lua_mqtt_unsuback(sc, cookie);
 		return;
 	}
 }
 
-struct wslv_mqtt_cmnd {
-	const char *name;
-	void (*handler)(struct wslv_softc *, const char *,
-	    const char *, size_t);
+struct wslv_mqtt_cmnd {
+	const char *name;
+	wslv_cmnd_builtin handler;
+};
+
+static void	wslv_mqtt_screen(struct wslv_softc *, const char *,
+		    const char *, size_t);
+static void	wslv_mqtt_brightness(struct wslv_softc *, const char *,
+		    const char *, size_t);
+static void	wslv_mqtt_teleperiod(struct wslv_softc *, const char *,
+		    const char *, size_t);
+
+static const struct wslv_mqtt_cmnd wslv_mqtt_cmnds[] = {
+	{ "screen",		wslv_mqtt_screen },
+	{ "brightness",		wslv_mqtt_brightness },
+	{ "teleperiod",		wslv_mqtt_teleperiod },
+};
+
+static inline int
+wslv_cmnd_tolower(int ch)
+{
+	if (ch >= 'A' && ch <= 'Z')
+		ch += 'a' - 'A';
+	return (ch);
+}
+
+/* command names are case insensitive, so fold case while hashing */
+static uint32_t
+wslv_cmnd_hash(const char *name, size_t len)
+{
+	uint32_t h = 2166136261U; /* fnv-1a */
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (uint8_t)wslv_cmnd_tolower(name[i]);
+		h *= 16777619U;
+	}
+
+	return (h);
+}
+
+static int
+wslv_cmnds_resize(struct wslv_cmnds *cs, unsigned int nbuckets)
+{
+	struct wslv_cmnd_bucket *buckets;
+	struct wslv_cmnd *c;
+	unsigned int i;
+
+	buckets = calloc(nbuckets, sizeof(*buckets));
+	if (buckets == NULL)
+		return (-1);
+
+	for (i = 0; i < nbuckets; i++)
+		SLIST_INIT(&buckets[i]);
+
+	if (cs->cs_buckets != NULL) {
+		for (i = 0; i <= cs->cs_mask; i++) {
+			while ((c = SLIST_FIRST(&cs->cs_buckets[i])) != NULL) {
+				SLIST_REMOVE_HEAD(&cs->cs_buckets[i], c_entry);
+				SLIST_INSERT_HEAD(
+				    &buckets[c->c_hash & (nbuckets - 1)],
+				    c, c_entry);
+			}
+		}
+		free(cs->cs_buckets);
+	}
+
+	cs->cs_buckets = buckets;
+	cs->cs_mask = nbuckets - 1;
+
+	return (0);
+}
+
+static void
+wslv_cmnds_init(struct wslv_softc *sc)
+{
+	size_t i;
+
+	if (wslv_cmnds_resize(&sc->sc_cmnds, WSLV_CMNDS_BUCKETS) == -1)
+		err(1, "cmnd table");
+
+	for (i = 0; i < nitems(wslv_mqtt_cmnds); i++) {
+		const struct wslv_mqtt_cmnd *cmnd = &wslv_mqtt_cmnds[i];
+
+		if (wslv_cmnd_insert(sc, cmnd->name, strlen(cmnd->name),
+		    cmnd->handler, LUA_NOREF) == NULL)
+			err(1, "cmnd %s", cmnd->name);
+	}
+}
+
+static struct wslv_cmnd *
+wslv_cmnd_lookup(struct wslv_softc *sc, const char *name, size_t len)
+{
+	struct wslv_cmnds *cs = &sc->sc_cmnds;
+	uint32_t h = wslv_cmnd_hash(name, len);
+	struct wslv_cmnd *c;
+
+	SLIST_FOREACH(c, &cs->cs_buckets[h & cs->cs_mask], c_entry) {
+		if (c->c_hash == h && c->c_len == len &&
+		    strncasecmp(c->c_name, name, len) == 0)
+			return (c);
+	}
+
+	return (NULL);
+}
+
+static struct wslv_cmnd *
+wslv_cmnd_insert(struct wslv_softc *sc, const char *name, size_t len,
+    wslv_cmnd_builtin builtin, int handler)
+{
+	struct wslv_cmnds *cs = &sc->sc_cmnds;
+	struct wslv_cmnd *c;
+	size_t i;
+
+	/* keep the chains short, but dont fail if the table cant grow */
+	if (cs->cs_count > cs->cs_mask)
+		wslv_cmnds_resize(cs, (cs->cs_mask + 1) * 2);
+
+	c = malloc(sizeof(*c) + len + 1);
+	if (c == NULL)
+		return (NULL);
+
+	c->c_name = (char *)(c + 1);
+	for (i = 0; i < len; i++)
+		c->c_name[i] = wslv_cmnd_tolower(name[i]);
+	c->c_name[len] = '\0';
+	c->c_len = len;
+	c->c_hash = wslv_cmnd_hash(name, len);
+	c->c_builtin = builtin;
+	c->c_handler = handler;
+
+	SLIST_INSERT_HEAD(&cs->cs_buckets[c->c_hash & cs->cs_mask],
+	    c, c_entry);
+	cs->cs_count++;
+
+	return (c);
+}
+
+static void
+wslv_cmnd_remove(struct wslv_softc *sc, struct wslv_cmnd *c)
+{
+	struct wslv_cmnds *cs = &sc->sc_cmnds;
+
+	SLIST_REMOVE(&cs->cs_buckets[c->c_hash & cs->cs_mask],
+	    c, wslv_cmnd, c_entry);
+	cs->cs_count--;
+
+	free(c);
+}
+
+static void
+wslv_mqtt_on_message(struct mqtt_conn *mc,
+    char *topic, size_t topic_len, char *payload, size_t payload_len,
+    enum mqtt_qos qos)
+{
+	struct wslv_softc *sc = mqtt_cookie(mc);
+	size_t name_len, device_len, off;
+	const char *name;
+	struct wslv_cmnd *c;
+
+	if (payload == NULL || *payload == '\0')
+		goto free;
+
+	if (topic_len <= prefix_cmnd_len) /* <= includes '/' */
+		goto decline;
+	if (strncmp(topic, prefix_cmnd, prefix_cmnd_len) != 0)
+		goto decline;
+	off = prefix_cmnd_len;
+	if (topic[off++] != '/')
+		goto decline;
+
+	device_len = strlen(sc->sc_mqtt_device);
+	if (topic_len <= (off + device_len)) /* <= includes '/' */
+		goto decline;
+	if (strncmp(topic + off, sc->sc_mqtt_device, device_len) != 0)
+		goto decline;
+	off += device_len;
+	if (topic[off++] != '/')
+		goto decline;
+
+	name = topic + off;
+	name_len = topic_len - off;
+
+	c = wslv_cmnd_lookup(sc, name, name_len);
+	if (c == NULL) {
+		wslv_lua_cmnd(sc, LUA_NOREF,
+		    name, name_len, payload, payload_len);
+	} else if (c->c_builtin != NULL)
+		(*c->c_builtin)(sc, name, payload, payload_len);
+	else {
+		wslv_lua_cmnd(sc, c->c_handler,
+		    name, name_len, payload, payload_len);
+	}
+	goto free;
+
+free:
+	free(topic);
+	free(payload);
+	return;
+
+decline:
+	wslv_lua_mqtt_message(sc, topic, topic_len, payload, payload_len, qos);
+}
+
+static const char *wslv_idle_state_names[] = {
+	[WSLV_IDLE_STATE_AWAKE] = "awake",
+	[WSLV_IDLE_STATE_DROWSY] = "drowsy",
+	[WSLV_IDLE_STATE_ASLEEP] = "asleep",
+};
+
+/* frame time in ms below which p percent of this periods frames were */
+static unsigned int
+wslv_frame_pct(const struct wslv_metrics *m, unsigned int p)
+{
+	unsigned int want, n = 0;
+	unsigned int i;
+
+	want = (m->m_frames * p + 99) / 100;
+	for (i = 0; i < WSLV_FRAME_BUCKETS - 1; i++) {
+		n += m->m_frame_hist[i];
+		if (n >= want)
+			return (i);
+	}
+
+	return (m->m_frame_max);
+}
+
+static void
+wslv_tele_frames(struct wslv_softc *sc, struct json_writer *jw,
+    uint32_t elapsed)
+{
+	struct wslv_metrics *m = &sc->sc_metrics;
+
+	json_w_object(jw, "frames");
+	json_w_uint(jw, "n", m->m_frames);
+	json_w_number(jw, "fps",
+	    elapsed ? m->m_frames * 1000.0 / elapsed : 0.0);
+	if (m->m_frames > 0) {
+		json_w_uint(jw, "p50", wslv_frame_pct(m, 50));
+		json_w_uint(jw, "p95", wslv_frame_pct(m, 95));
+		json_w_uint(jw, "p99", wslv_frame_pct(m, 99));
+		json_w_uint(jw, "max", m->m_frame_max);
+	}
+	json_w_end_object(jw);
+}
+
+/* lvgl only knows how its heap is doing if it manages it itself */
+static void
+wslv_tele_lvgl(struct wslv_softc *sc, struct json_writer *jw)
+{
+#if LV_USE_STDLIB_MALLOC == LV_STDLIB_BUILTIN
+	lv_mem_monitor_t mon;
+
+	lv_mem_monitor(&mon);
+
+	json_w_object(jw, "lvgl");
+	json_w_uint(jw, "total", mon.total_size);
+	json_w_uint(jw, "free", mon.free_size);
+	json_w_uint(jw, "hwm", mon.max_used);
+	json_w_uint(jw, "used_pct", mon.used_pct);
+	json_w_uint(jw, "frag_pct", mon.frag_pct);
+	json_w_end_object(jw);
+#endif
+}
+
+static void
+wslv_mqtt_tele(struct wslv_softc *sc)
+{
+	struct wslv_metrics *m = &sc->sc_metrics;
+	struct wslv_mqtt_wbuf *wb = &sc->sc_mqtt_wbuf;
+	unsigned int metrics = sc->sc_tele_metrics;
+	char topic[128];
+	struct json_writer jw;
+	const char *buf;
+	size_t tlen, plen;
+	uint32_t now, elapsed;
+	unsigned int i;
+	int rv;
+
+	if (sc->sc_tele_buf == NULL)
+		return;
+
+	rv = snprintf(topic, sizeof(topic), "tele/%s/STATUS",
+	    sc->sc_mqtt_device);
+	if (rv == -1)
+		errx(1, "mqtt tele topic");
+	tlen = rv;
+	if (tlen >= sizeof(topic))
+		errx(1, "mqtt tele topic len");
+
+	now = wslv_ms();
+	elapsed = now - m->m_period_start;
+
+	json_w_init(&jw, sc->sc_tele_buf, WSLV_TELE_BUFLEN);
+	json_w_object(&jw, NULL);
+	json_w_str(&jw, "idle",
+	    sc->sc_idle > WSLV_IDLE_STATE_AWAKE ? "ON" : "OFF");
+	json_w_str(&jw, "screen",
+	    sc->sc_idle < WSLV_IDLE_STATE_ASLEEP ? "ON" : "OFF");
+	json_w_str(&jw, "state", wslv_idle_state_names[sc->sc_idle]);
+
+	if (sc->sc_ws_brightness.param) {
+		json_w_object(&jw, "brightness");
+		json_w_int(&jw, "v", sc->sc_ws_brightness.curval);
+		json_w_int(&jw, "min", sc->sc_ws_brightness.min);
+		json_w_int(&jw, "max", sc->sc_ws_brightness.max);
+		json_w_end_object(&jw);
+	}
+
+	json_w_uint(&jw, "period", sc->sc_tele_secs);
+	json_w_uint(&jw, "elapsed", elapsed);
+
+	if (metrics & WSLV_TELE_M_LOOP) {
+		json_w_object(&jw, "loop");
+		json_w_uint(&jw, "wakeups", m->m_wakeups);
+		json_w_end_object(&jw);
+	}
+
+	if (metrics & WSLV_TELE_M_FRAMES)
+		wslv_tele_frames(sc, &jw, elapsed);
+
+	if (metrics & WSLV_TELE_M_MQTT) {
+		json_w_object(&jw, "mqtt");
+		json_w_uint(&jw, "writes", wb->wb_writes);
+		json_w_uint(&jw, "bytes", wb->wb_bytes);
+		json_w_uint(&jw, "pkts", wb->wb_pkts);
+		json_w_uint(&jw, "rd_bytes", m->m_mqtt_rd_bytes);
+		json_w_uint(&jw, "wbuf", wb->wb_prod - wb->wb_cons);
+		json_w_uint(&jw, "queue", sc->sc_mqtt_queue_len);
+		json_w_uint(&jw, "queue_bytes", sc->sc_mqtt_queue_bytes);
+		json_w_uint(&jw, "queue_drops", sc->sc_mqtt_queue_drops);
+		json_w_uint(&jw, "reconnects", sc->sc_mqtt_reconnects);
+		json_w_end_object(&jw);
+	}
+
+	if (metrics & WSLV_TELE_M_LUA) {
+		json_w_object(&jw, "lua");
+		if (sc->sc_L != NULL) {
+			json_w_uint(&jw, "heap",
+			    (uint64_t)lua_gc(sc->sc_L, LUA_GCCOUNT, 0) * 1024 +
+			    lua_gc(sc->sc_L, LUA_GCCOUNTB, 0));
+			json_w_uint(&jw, "lv_skipped",
+			    lua_lv_skipped(sc->sc_L));
+		}
+		json_w_uint(&jw, "conflated", sc->sc_L_conflated);
+		json_w_uint(&jw, "deduped", sc->sc_pub_deduped);
+		json_w_uint(&jw, "limited", sc->sc_pub_limited);
+		json_w_end_object(&jw);
+	}
+
+	if (metrics & WSLV_TELE_M_POOL) {
+		/* the item size of pool i is 32 << i */
+		json_w_object(&jw, "pool");
+		json_w_array(&jw, "use");
+		for (i = 0; i < WSLV_POOL_CLASSES; i++)
+			json_w_uint(&jw, NULL, sc->sc_pools[i].p_inuse);
+		json_w_end_array(&jw);
+		json_w_array(&jw, "hwm");
+		for (i = 0; i < WSLV_POOL_CLASSES; i++)
+			json_w_uint(&jw, NULL, sc->sc_pools[i].p_hwm);
+		json_w_end_array(&jw);
+		json_w_array(&jw, "slabs");
+		for (i = 0; i < WSLV_POOL_CLASSES; i++)
+			json_w_uint(&jw, NULL, sc->sc_pools[i].p_slabs);
+		json_w_end_array(&jw);
+		json_w_uint(&jw, "big", sc->sc_pool_big);
+		json_w_end_object(&jw);
+	}
+
+	if (metrics & WSLV_TELE_M_LVGL)
+		wslv_tele_lvgl(sc, &jw);
+
+	json_w_end_object(&jw);
+	if (json_w_finish(&jw, &buf, &plen) == -1) {
+		warnx("mqtt tele payload len");
+		return;
+	}
+
+	if (wslv_mqtt_publish(sc, topic, tlen, buf, plen,
+	    MQTT_QOS0, MQTT_NORETAIN) == -1)
+		warnx("mqtt publish %s", topic);
+}
+
+/*
+ * STATUS is also published when the screen or brightness changes,
+ * so only the periodic one starts a new period. the others report
+ * the current period so far.
+ */
+static void
+wslv_metrics_period(struct wslv_softc *sc)
+{
+	struct wslv_metrics *m = &sc->sc_metrics;
+	struct wslv_mqtt_wbuf *wb = &sc->sc_mqtt_wbuf;
+
+	m->m_period_start = wslv_ms();
+	m->m_wakeups = 0;
+	m->m_frames = 0;
+	m->m_frame_max = 0;
+	memset(m->m_frame_hist, 0, sizeof(m->m_frame_hist));
+	m->m_mqtt_rd_bytes = 0;
+
+	wb->wb_writes = 0;
+	wb->wb_bytes = 0;
+	wb->wb_pkts = 0;
+	sc->sc_mqtt_queue_drops = 0;
+	sc->sc_mqtt_reconnects = 0;
+	sc->sc_pool_big = 0;
+
+	sc->sc_L_conflated = 0;
+	sc->sc_pub_deduped = 0;
+	sc->sc_pub_limited = 0;
+	if (sc->sc_L != NULL)
+		lua_lv_skipped_reset(sc->sc_L);
+}
+
+void
+wslv_tele(struct wslv_softc *sc, const char *suffix, size_t suffix_len,
+    const char *payload, size_t payload_len, enum mqtt_qos qos)
+{
+	char topic[128];
+	size_t topic_len;
+	int rv;
+
+	rv = snprintf(topic, sizeof(topic), "tele/%s/%s",
+	    sc->sc_mqtt_device, suffix);
+	if (rv == -1)
+		errx(1, "mqtt tele topic");
+	topic_len = rv;
+	if (topic_len >= sizeof(topic)) {
+		warnx("mqtt_tele topic len");
+		return;
+	}
+
+	if (wslv_pub(sc, topic, topic_len, payload, payload_len,
+	    qos, MQTT_NORETAIN) == -1)
+		warnx("mqtt publish %s", topic);
+}
+
+static void
+wslv_mqtt_tele_period(int nope, short events, void *arg)
+{
+	struct wslv_softc *sc = arg;
+	struct timeval rate = { sc->sc_tele_secs, 0 };
+
+	wslv_wakeup(sc);
+	evtimer_add(&sc->sc_mqtt_tele_period, &rate);
+
+	wslv_mqtt_tele(sc);
+	wslv_metrics_period(sc);
+}
+
+static void
+wslv_mqtt_screen(struct wslv_softc *sc, const char *name,
+    const char *payload, size_t payload_len)
+{
+	int oscreen = sc->sc_idle < WSLV_IDLE_STATE_ASLEEP;
+	int nscreen;
+
+	if (strcasecmp(payload, "on") == 0 ||
+	    strcasecmp(payload, "1") == 0)
+		nscreen = 1;
+	else if (strcasecmp(payload, "off") == 0 ||
+	    strcasecmp(payload, "0") == 0)
+		nscreen = 0;
+	else if (strcasecmp(payload, "toggle") == 0 ||
+	    strcasecmp(payload, "2") == 0)
+		nscreen = !oscreen;
+	else
+		return;
+
+	if (nscreen) {
+		sc->sc_idle = WSLV_IDLE_STATE_AWAKE;
+		evtimer_add(&sc->sc_idle_ev, &sc->sc_idle_time);
+	} else {
+		sc->sc_idle = WSLV_IDLE_STATE_ASLEEP;
+		evtimer_del(&sc->sc_idle_ev);
+	}
+
+	if (nscreen != oscreen) {
+		if (nscreen) {
+			wslv_svideo(sc, 1);
+			wslv_wake(sc);
+		} else {
+			wslv_sleep(sc);
+		}
+	}
+
+	wslv_mqtt_tele(sc);
+}
+
+static void
+wslv_mqtt_brightness(struct wslv_softc *sc, const char *name,
+    const char *payload, size_t payload_len)
+{
+	struct wsdisplay_param param;
+	int val;
+	const char *errstr;
+
+	if (sc->sc_ws_brightness.param == 0)
+		return;
+
+	val = strtonum(payload,
+	    sc->sc_ws_brightness.min, sc->sc_ws_brightness.max,
+	    &errstr);
+	if (errstr != NULL)
+		goto tele;
+
+	param = sc->sc_ws_brightness;
+	param.curval = val;
+
+	if (ioctl(sc->sc_ws_fd, WSDISPLAYIO_SETPARAM, &param) == -1) {
+		warn("mqtt set brightness");
+		goto tele;
+	}
+
+	sc->sc_ws_brightness.curval = val;
+
+tele:
+	wslv_mqtt_tele(sc);
+}
+
+static void
+wslv_tele_set_period(struct wslv_softc *sc, unsigned int secs)
+{
+	struct timeval rate = { secs, 0 };
+
+	sc->sc_tele_secs = secs;
+
+	/* only reschedule if the period is already running */
+	if (evtimer_pending(&sc->sc_mqtt_tele_period, NULL)) {
+		evtimer_add(&sc->sc_mqtt_tele_period, &rate);
+		wslv_metrics_period(sc);
+	}
+}
+
+static void
+wslv_mqtt_teleperiod(struct wslv_softc *sc, const char *name,
+    const char *payload, size_t payload_len)
+{
+	unsigned int secs;
+	const char *errstr;
+
+	if (payload_len > 0) {
+		secs = strtonum(payload,
+		    WSLV_TELE_PERIOD_MIN, WSLV_TELE_PERIOD_MAX, &errstr);
+		if (errstr == NULL)
+			wslv_tele_set_period(sc, secs);
+	}
+
+	wslv_mqtt_tele(sc);
+}
+
+static void
+wslv_mqtt_dead(struct mqtt_conn *mc)
+{
+	struct wslv_softc *sc = mqtt_cookie(mc);
+
+	warnx("%s", __func__);
+	wslv_mqtt_fail(sc);
+}
+
+uint32_t
+wslv_ms(void)
+{
+	struct timespec ts;
+	uint64_t rv;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+		abort();
+
+	rv = (uint64_t)ts.tv_sec * 1000;
+	rv += (uint64_t)ts.tv_nsec / 1000000;
+
+	return (rv);
+}
+
+const lv_font_t *
+wslv_font_default(void)
+{
+	return (LV_FONT_DEFAULT);
+}
+
+/*
+ * topic filter trie
+ *
+ * each level of a subscription filter is a node in the trie. literal
+ * levels are kept in an rb tree under their parent, while the + and #
+ * wildcards hang off their own pointers. matching a topic walks the
+ * trie one level at a time, following the literal, + and # branches.
+ */
+
+static inline int
+wslv_topic_node_cmp(const struct wslv_topic_node *a,
+    const struct wslv_topic_node *b)
+{
+	size_t len = MIN(a->tn_len, b->tn_len);
+	int rv;
+
+	rv = memcmp(a->tn_name, b->tn_name, len);
+	if (rv != 0)
+		return (rv);
+
+	if (a->tn_len > b->tn_len)
+		return (1);
+	if (a->tn_len < b->tn_len)
+		return (-1);
+
+	return (0);
+}
+
+RBT_GENERATE(wslv_topic_nodes, wslv_topic_node, tn_entry, wslv_topic_node_cmp);
+
+static int
+wslv_mqtt_check_filter(const char *filter, size_t len, const char **errstr)
+{
+	size_t i, level = 0;
+
+	if (len == 0) {
+		*errstr = "empty";
+		return (-1);
+	}
+
+	for (i = 0; i < len; i++) {
+		switch (filter[i]) {
+		case '\0':
+			*errstr = "contains nul";
+			return (-1);
+		case '/':
+			level = i + 1;
+			break;
+		case '+':
+			if (i != level ||
+			    (i + 1 < len && filter[i + 1] != '/')) {
+				*errstr = "+ must occupy an entire level";
+				return (-1);
+			}
+			break;
+		case '#':
+			if (i != level || i + 1 != len) {
+				*errstr = "# must be the last level";
+				return (-1);
+			}
+			break;
+		}
+	}
+
+	return (0);
+}
+
+static struct wslv_topic_node *
+wslv_topic_node_alloc(struct wslv_topic_node *parent,
+    const char *name, size_t len)
+{
+	struct wslv_topic_node *tn;
+
+	tn = malloc(sizeof(*tn) + len);
+	if (tn == NULL)
+		return (NULL);
+
+	tn->tn_parent = parent;
+	RBT_INIT(wslv_topic_nodes, &tn->tn_children);
+	tn->tn_plus = NULL;
+	tn->tn_hash = NULL;
+	TAILQ_INIT(&tn->tn_subs);
+	tn->tn_name = (char *)(tn + 1);
+	memcpy(tn->tn_name, name, len);
+	tn->tn_len = len;
+
+	return (tn);
+}
+
+static int
+wslv_topic_node_empty(const struct wslv_topic_node *tn)
+{
+	return (TAILQ_EMPTY(&tn->tn_subs) &&
+	    RBT_EMPTY(wslv_topic_nodes, &tn->tn_children) &&
+	    tn->tn_plus == NULL && tn->tn_hash == NULL);
+}
+
+/* free the branch back to the last node that is still used */
+static void
+wslv_topic_prune(struct wslv_topic_node *tn)
+{
+	struct wslv_topic_node *parent;
+
+	while ((parent = tn->tn_parent) != NULL && wslv_topic_node_empty(tn)) {
+		if (parent->tn_plus == tn)
+			parent->tn_plus = NULL;
+		else if (parent->tn_hash == tn)
+			parent->tn_hash = NULL;
+		else {
+			RBT_REMOVE(wslv_topic_nodes,
+			    &parent->tn_children, tn);
+		}
+
+		free(tn);
+		tn = parent;
+	}
+}
+
+/* the filter must have been checked with wslv_mqtt_check_filter */
+static int
+wslv_topic_insert(struct wslv_topic_node *root, struct wslv_lua_mqtt_sub *lsub)
+{
+	struct wslv_topic_node *tn = root;
+	struct wslv_topic_node key, *child, **slot;
+	const char *filter = lsub->filter;
+	size_t len = lsub->len;
+	const char *sep;
+	size_t llen;
+
+	for (;;) {
+		sep = memchr(filter, '/', len);
+		llen = (sep != NULL) ? (size_t)(sep - filter) : len;
+
+		slot = NULL;
+		if (llen == 1 && filter[0] == '+')
+			slot = &tn->tn_plus;
+		else if (llen == 1 && filter[0] == '#')
+			slot = &tn->tn_hash;
+
+		if (slot != NULL) {
+			child = *slot;
+			if (child == NULL) {
+				child = wslv_topic_node_alloc(tn, filter, llen);
+				if (child == NULL)
+					goto fail;
+				*slot = child;
+			}
+		} else {
+			key.tn_name = (char *)filter;
+			key.tn_len = llen;
+
+			child = RBT_FIND(wslv_topic_nodes,
+			    &tn->tn_children, &key);
+			if (child == NULL) {
+				child = wslv_topic_node_alloc(tn, filter, llen);
+				if (child == NULL)
+					goto fail;
+				RBT_INSERT(wslv_topic_nodes,
+				    &tn->tn_children, child);
+			}
+		}
+
+		tn = child;
+		if (sep == NULL)
+			break;
+
+		filter = sep + 1;
+		len -= llen + 1;
+	}
+
+	TAILQ_INSERT_TAIL(&tn->tn_subs, lsub, nentry);
+	lsub->node = tn;
+
+	return (0);
+
+fail:
+	/* don't leave the levels created so far behind */
+	wslv_topic_prune(tn);
+	return (-1);
+}
+
+static void
+wslv_topic_remove(struct wslv_lua_mqtt_sub *lsub)
+{
+	struct wslv_topic_node *tn = lsub->node;
+
+	if (tn == NULL)
+		return;
+
+	TAILQ_REMOVE(&tn->tn_subs, lsub, nentry);
+	lsub->node = NULL;
+
+	wslv_topic_prune(tn);
+}
+
+static void
+wslv_topic_subs(const struct wslv_topic_node *tn,
+    void (*fn)(struct wslv_lua_mqtt_sub *, void *), void *arg)
+{
+	struct wslv_lua_mqtt_sub *lsub;
+
+	TAILQ_FOREACH(lsub, &tn->tn_subs, nentry)
+		(*fn)(lsub, arg);
+}
+
+static void	wslv_topic_match_level(const struct wslv_topic_node *,
+		    const char *, size_t, int,
+		    void (*)(struct wslv_lua_mqtt_sub *, void *), void *);
+
+static void
+wslv_topic_match_node(const struct wslv_topic_node *tn,
+    const char *rest, size_t rlen,
+    void (*fn)(struct wslv_lua_mqtt_sub *, void *), void *arg)
+{
+	if (rest != NULL) {
+		wslv_topic_match_level(tn, rest, rlen, 0, fn, arg);
+		return;
+	}
+
+	/* the topic ends here, which "a/#" also matches for "a" */
+	wslv_topic_subs(tn, fn, arg);
+	if (tn->tn_hash != NULL)
+		wslv_topic_subs(tn->tn_hash, fn, arg);
+}
+
+static void
+wslv_topic_match_level(const struct wslv_topic_node *tn,
+    const char *topic, size_t len, int first,
+    void (*fn)(struct wslv_lua_mqtt_sub *, void *), void *arg)
+{
+	struct wslv_topic_node key, *child;
+	const char *sep, *rest = NULL;
+	size_t llen, rlen = 0;
+	int wild = 1;
+
+	/* wildcards on the first level dont match $SYS style topics */
+	if (first && len > 0 && topic[0] == '$')
+		wild = 0;
+
+	if (wild && tn->tn_hash != NULL)
+		wslv_topic_subs(tn->tn_hash, fn, arg);
+
+	sep = memchr(topic, '/', len);
+	if (sep != NULL) {
+		llen = sep - topic;
+		rest = sep + 1;
+		rlen = len - (llen + 1);
+	} else
+		llen = len;
+
+	key.tn_name = (char *)topic;
+	key.tn_len = llen;
+	child = RBT_FIND(wslv_topic_nodes,
+	    (struct wslv_topic_nodes *)&tn->tn_children, &key);
+	if (child != NULL)
+		wslv_topic_match_node(child, rest, rlen, fn, arg);
+
+	if (wild && tn->tn_plus != NULL)
+		wslv_topic_match_node(tn->tn_plus, rest, rlen, fn, arg);
+}
+
+static void
+wslv_topic_match(const struct wslv_topic_node *root,
+    const char *topic, size_t len,
+    void (*fn)(struct wslv_lua_mqtt_sub *, void *), void *arg)
+{
+	if (root == NULL)
+		return;
+
+	wslv_topic_match_level(root, topic, len, 1, fn, arg);
+}
+
+/*
+ * publish policies
+ *
+ * a lua script can ask for publishes to a topic to be spaced out by
+ * a minimum interval, for unchanged payloads to be dropped, and for
+ * only a few of them to be queued for the socket at a time. anything
+ * held back by the interval or the inflight limit is kept as the
+ * pending value for the topic, and newer publishes replace it. the
+ * pending value goes out when the interval expires or the socket
+ * drains, so the broker always ends up with the latest value.
+ */
+
+static inline int
+wslv_pub_policy_cmp(const struct wslv_pub_policy *a,
+    const struct wslv_pub_policy *b)
+{
+	size_t len = MIN(a->p_topic_len, b->p_topic_len);
+	int rv;
+
+	rv = memcmp(a->p_topic, b->p_topic, len);
+	if (rv != 0)
+		return (rv);
+
+	if (a->p_topic_len > b->p_topic_len)
+		return (1);
+	if (a->p_topic_len < b->p_topic_len)
+		return (-1);
+
+	return (0);
+}
+
+RBT_GENERATE(wslv_pub_policies, wslv_pub_policy, p_entry,
+    wslv_pub_policy_cmp);
+
+static struct wslv_pub_policy *
+wslv_pub_policy_lookup(struct wslv_softc *sc, const char *topic, size_t len)
+{
+	struct wslv_pub_policy key;
+
+	key.p_topic = (char *)topic;
+	key.p_topic_len = len;
+
+	return (RBT_FIND(wslv_pub_policies, &sc->sc_pub_policies, &key));
+}
+
+static int
+wslv_pub_send(struct wslv_pub_policy *p, const char *payload, size_t len,
+    enum mqtt_qos qos, int retain)
+{
+	struct wslv_softc *sc = p->p_sc;
+	char *sent;
+
+	if (p->p_dedup && p->p_sent && len == p->p_sent_len &&
+	    memcmp(payload, p->p_sent_payload, len) == 0) {
+		sc->sc_pub_deduped++;
+		return (0);
+	}
+
+	if (wslv_mqtt_publish(sc, p->p_topic, p->p_topic_len,
+	    payload, len, qos, retain) == -1)
+		return (-1);
+
+	p->p_last = wslv_ms();
+	p->p_sent = 1;
+
+	if (p->p_gen != sc->sc_mqtt_wbuf.wb_gen) {
+		p->p_gen = sc->sc_mqtt_wbuf.wb_gen;
+		p->p_inflight = 0;
+	}
+	p->p_inflight++;
+
+	if (p->p_dedup) {
+		sent = realloc(p->p_sent_payload, len ? len : 1);
+		if (sent == NULL) {
+			/* forget what was sent rather than compare garbage */
+			p->p_sent = 0;
+			return (0);
+		}
+		memcpy(sent, payload, len);
+		p->p_sent_payload = sent;
+		p->p_sent_len = len;
+	}
+
+	return (0);
+}
+
+static int
+wslv_pub_blocked(struct wslv_pub_policy *p)
+{
+	struct wslv_softc *sc = p->p_sc;
+
+	if (p->p_inflight_max == 0)
+		return (0);
+	if (p->p_gen != sc->sc_mqtt_wbuf.wb_gen)
+		return (0);
+
+	return (p->p_inflight >= p->p_inflight_max);
+}
+
+/* how long until the interval allows another publish */
+static uint32_t
+wslv_pub_wait(struct wslv_pub_policy *p)
+{
+	uint32_t diff;
+
+	if (p->p_interval == 0 || !p->p_sent)
+		return (0);
+
+	diff = wslv_ms() - p->p_last;
+	if (diff >= p->p_interval)
+		return (0);
+
+	return (p->p_interval - diff);
+}
+
+static void
+wslv_pub_kick(struct wslv_pub_policy *p)
+{
+	struct wslv_softc *sc = p->p_sc;
+	struct timeval tv;
+	uint32_t wait;
+
+	if (!p->p_pending)
+		return;
+
+	wait = wslv_pub_wait(p);
+	if (wait > 0) {
+		tv.tv_sec = wait / 1000;
+		tv.tv_usec = (wait % 1000) * 1000;
+		evtimer_add(&p->p_ev, &tv);
+		return;
+	}
+
+	if (wslv_pub_blocked(p)) {
+		if (!p->p_blocked) {
+			TAILQ_INSERT_TAIL(&sc->sc_pub_blocked, p, p_bentry);
+			p->p_blocked = 1;
+		}
+		return;
+	}
+
+	p->p_pending = 0;
+	if (wslv_pub_send(p, p->p_pend_payload, p->p_pend_len,
+	    p->p_pend_qos, p->p_pend_retain) == -1)
+		warnx("mqtt publish %.*s", (int)p->p_topic_len, p->p_topic);
+}
+
+static void
+wslv_pub_ev(int nil, short events, void *arg)
+{
+	struct wslv_pub_policy *p = arg;
+
+	wslv_pub_kick(p);
+}
+
+/* the socket has caught up, so let the held back topics go again */
+static void
+wslv_pub_drained(struct wslv_softc *sc)
+{
+	struct wslv_pub_blocked list;
+	struct wslv_pub_policy *p;
+
+	if (TAILQ_EMPTY(&sc->sc_pub_blocked))
+		return;
+
+	TAILQ_INIT(&list);
+	TAILQ_CONCAT(&list, &sc->sc_pub_blocked, p_bentry);
+
+	while ((p = TAILQ_FIRST(&list)) != NULL) {
+		TAILQ_REMOVE(&list, p, p_bentry);
+		p->p_blocked = 0;
+
+		wslv_pub_kick(p);
+	}
+}
+
+static int
+wslv_pub(struct wslv_softc *sc, const char *topic, size_t topic_len,
+    const char *payload, size_t payload_len, enum mqtt_qos qos, int retain)
+{
+	struct wslv_pub_policy *p;
+	char *pend;
+
+	p = wslv_pub_policy_lookup(sc, topic, topic_len);
+	if (p == NULL) {
+		return (wslv_mqtt_publish(sc, topic, topic_len,
+		    payload, payload_len, qos, retain));
+	}
+
+	if (!p->p_pending && wslv_pub_wait(p) == 0 && !wslv_pub_blocked(p))
+		return (wslv_pub_send(p, payload, payload_len, qos, retain));
+
+	/* hold on to the latest value until it can be sent */
+	pend = realloc(p->p_pend_payload, payload_len ? payload_len : 1);
+	if (pend == NULL)
+		return (-1);
+	memcpy(pend, payload, payload_len);
+
+	if (p->p_pending)
+		sc->sc_pub_limited++;
+
+	p->p_pend_payload = pend;
+	p->p_pend_len = payload_len;
+	p->p_pend_qos = qos;
+	p->p_pend_retain = retain;
+	p->p_pending = 1;
+
+	wslv_pub_kick(p);
+
+	return (0);
+}
+
+static void
+wslv_pub_policy_free(struct wslv_softc *sc, struct wslv_pub_policy *p)
+{
+	/* dont lose the latest value on the way out */
+	if (p->p_pending) {
+		if (wslv_mqtt_publish(sc, p->p_topic, p->p_topic_len,
+		    p->p_pend_payload, p->p_pend_len,
+		    p->p_pend_qos, p->p_pend_retain) == -1) {
+			warnx("mqtt publish %.*s",
+			    (int)p->p_topic_len, p->p_topic);
+		}
+	}
+
+	evtimer_del(&p->p_ev);
+	if (p->p_blocked)
+		TAILQ_REMOVE(&sc->sc_pub_blocked, p, p_bentry);
+	RBT_REMOVE(wslv_pub_policies, &sc->sc_pub_policies, p);
+
+	free(p->p_pend_payload);
+	free(p->p_sent_payload);
+	free(p->p_topic);
+	free(p);
+}
+
+static void
+wslv_pub_policies_clear(struct wslv_softc *sc)
+{
+	struct wslv_pub_policy *p;
+
+	while ((p = RBT_ROOT(wslv_pub_policies,
+	    &sc->sc_pub_policies)) != NULL)
+		wslv_pub_policy_free(sc, p);
+}
+
+static struct wslv_pub_policy *
+wslv_pub_policy_get(struct wslv_softc *sc, const char *topic, size_t len)
+{
+	struct wslv_pub_policy *p;
+
+	p = wslv_pub_policy_lookup(sc, topic, len);
+	if (p != NULL)
+		return (p);
+
+	p = calloc(1, sizeof(*p));
+	if (p == NULL)
+		return (NULL);
+
+	p->p_topic = malloc(len);
+	if (p->p_topic == NULL) {
+		free(p);
+		return (NULL);
+	}
+	memcpy(p->p_topic, topic, len);
+	p->p_topic_len = len;
+	p->p_sc = sc;
+	evtimer_set(&p->p_ev, wslv_pub_ev, p);
+
+	RBT_INSERT(wslv_pub_policies, &sc->sc_pub_policies, p);
+
+	return (p);
+}
+
+/*
+ * last value cache
+ *
+ * the most recent payload for every topic the lua script receives is
+ * kept here so a reloaded script can paint the current state straight
+ * away instead of waiting for retained messages to come round again.
+ * the cache is bounded by WSLV_LAST_BYTES, and the least recently
+ * used topics are evicted to stay under it.
+ */
+
+static inline int
+wslv_last_cmp(const struct wslv_last *a, const struct wslv_last *b)
+{
+	size_t len = MIN(a->l_topic_len, b->l_topic_len);
+	int rv;
+
+	rv = memcmp(a->l_topic, b->l_topic, len);
+	if (rv != 0)
+		return (rv);
+
+	if (a->l_topic_len > b->l_topic_len)
+		return (1);
+	if (a->l_topic_len < b->l_topic_len)
+		return (-1);
+
+	return (0);
+}
+
+RBT_GENERATE(wslv_last_tree, wslv_last, l_rbentry, wslv_last_cmp);
+
+static inline size_t
+wslv_last_size(const struct wslv_last *l)
+{
+	return (sizeof(*l) + l->l_topic_len + l->l_payload_len);
+}
+
+static void
+wslv_last_remove(struct wslv_softc *sc, struct wslv_last *l)
+{
+	RBT_REMOVE(wslv_last_tree, &sc->sc_last_tree, l);
+	TAILQ_REMOVE(&sc->sc_last_list, l, l_entry);
+	sc->sc_last_bytes -= wslv_last_size(l);
+
+	wslv_pool_put(sc, l->l_payload, l->l_payload_len);
+	wslv_pool_put(sc, l, sizeof(*l) + l->l_topic_len);
+}
+
+static struct wslv_last *
+wslv_last_lookup(struct wslv_softc *sc, const char *topic, size_t len)
+{
+	struct wslv_last key, *l;
+
+	key.l_topic = (char *)topic;
+	key.l_topic_len = len;
+	l = RBT_FIND(wslv_last_tree, &sc->sc_last_tree, &key);
+	if (l == NULL)
+		return (NULL);
+
+	TAILQ_REMOVE(&sc->sc_last_list, l, l_entry);
+	TAILQ_INSERT_TAIL(&sc->sc_last_list, l, l_entry);
+
+	return (l);
+}
+
+static void
+wslv_last_update(struct wslv_softc *sc, const char *topic, size_t topic_len,
+    const char *payload, size_t payload_len)
+{
+	struct wslv_last *l;
+	char *p;
+
+	if (sizeof(*l) + topic_len + payload_len > WSLV_LAST_BYTES)
+		return;
+
+	p = wslv_pool_get(sc, payload_len);
+	if (p == NULL) {
+		warn("%s", __func__);
+		return;
+	}
+	memcpy(p, payload, payload_len);
+
+	l = wslv_last_lookup(sc, topic, topic_len);
+	if (l != NULL) {
+		sc->sc_last_bytes -= l->l_payload_len;
+		wslv_pool_put(sc, l->l_payload, l->l_payload_len);
+	} else {
+		l = wslv_pool_get(sc, sizeof(*l) + topic_len);
+		if (l == NULL) {
+			warn("%s", __func__);
+			wslv_pool_put(sc, p, payload_len);
+			return;
+		}
+		l->l_topic = (char *)(l + 1);
+		memcpy(l->l_topic, topic, topic_len);
+		l->l_topic_len = topic_len;
+		l->l_payload_len = 0;
+
+		RBT_INSERT(wslv_last_tree, &sc->sc_last_tree, l);
+		TAILQ_INSERT_TAIL(&sc->sc_last_list, l, l_entry);
+		sc->sc_last_bytes += wslv_last_size(l);
+	}
+
+	l->l_payload = p;
+	l->l_payload_len = payload_len;
+	sc->sc_last_bytes += payload_len;
+
+	/* the entry just updated is at the tail, so it survives */
+	while (sc->sc_last_bytes > WSLV_LAST_BYTES)
+		wslv_last_remove(sc, TAILQ_FIRST(&sc->sc_last_list));
+}
+
+/*
+ * image sinks
+ *
+ * a subscription can send its payloads straight to an image widget.
+ * the payload buffer from amqtt becomes the source of the image, and
+ * the lvgl image decoders take it from there. this avoids copying
+ * large images into lua strings just to hand them back to lvgl.
+ */
+
+struct wslv_image_feed {
+	char				*payload;
+	size_t				 len;
+	unsigned int			 sinks;
+	unsigned int			 others;
+	int				 give;
+	int				 given;
 };
 
-static void	wslv_mqtt_screen(struct wslv_softc *, const char *,
-		    const char *, size_t);
-static void	wslv_mqtt_brightness(struct wslv_softc *, const char *,
-		    const char *, size_t);
+static void
+wslv_image_sink_release(struct wslv_image_sink *is)
+{
+	if (is->is_img == NULL)
+		return;
 
-static const struct wslv_mqtt_cmnd wslv_mqtt_cmnds[] = {
-	{ "screen",		wslv_mqtt_screen },
-	{ "brightness",		wslv_mqtt_brightness },
+	lv_image_cache_drop(is->is_img);
+	lv_draw_buf_destroy(is->is_img);
+	is->is_img = NULL;
+}
+
+static void
+wslv_image_sink_deleted(lv_event_t *e)
+{
+	struct wslv_image_sink *is = lv_event_get_user_data(e);
+
+	is->is_obj = NULL;
+	wslv_image_sink_release(is);
+}
+
+static struct wslv_image_sink *
+wslv_image_sink_create(struct wslv_softc *sc, lv_obj_t *obj)
+{
+	struct wslv_image_sink *is;
+
+	is = calloc(1, sizeof(*is));
+	if (is == NULL)
+		return (NULL);
+
+	is->is_obj = obj;
+	lv_obj_add_event_cb(obj, wslv_image_sink_deleted,
+	    LV_EVENT_DELETE, is);
+	sc->sc_image_sinks++;
+
+	return (is);
+}
+
+static void
+wslv_image_sink_free(struct wslv_softc *sc, struct wslv_image_sink *is)
+{
+	if (is->is_obj != NULL) {
+		lv_image_set_src(is->is_obj, NULL);
+		lv_obj_remove_event_cb_with_user_data(is->is_obj,
+		    wslv_image_sink_deleted, is);
+	}
+	wslv_image_sink_release(is);
+
+	sc->sc_image_sinks--;
+	free(is);
+}
+
+/*
+ * lodepng and tjpgd are the image decoders built in lv_conf.h, and
+ * they recognise pngs and jpegs in memory by their signatures. the
+ * image cache is disabled, so a widget showing the encoded payload
+ * would decode it again on every redraw. instead it's drawn once
+ * into a buffer of pixels that the widget then uses directly, and
+ * the payload is freed straight away.
+ */
+static const uint8_t wslv_png_sig[] = {
+	0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'
+};
+static const uint8_t wslv_jpeg_sig[] = {
+	0xff, 0xd8, 0xff
 };
 
-static const struct wslv_mqtt_cmnd *
-wslv_mqtt_cmnd(const char *name, size_t name_len)
+static int
+wslv_image_sig(const char *buf, size_t len, const uint8_t *sig, size_t siglen)
 {
-	size_t i;
+	return (len >= siglen && memcmp(buf, sig, siglen) == 0);
+}
 
-	for (i = 0; i < nitems(wslv_mqtt_cmnds); i++) {
-		const struct wslv_mqtt_cmnd *cmnd = &wslv_mqtt_cmnds[i];
-		if (strncasecmp(cmnd->name, name, name_len) == 0)
-			return (cmnd);
+static lv_draw_buf_t *
+wslv_image_decode(const char *buf, size_t len)
+{
+	lv_image_dsc_t src;
+	lv_image_header_t header;
+	lv_draw_image_dsc_t dsc;
+	lv_draw_buf_t *img;
+	lv_obj_t *canvas;
+	lv_layer_t layer;
+	lv_area_t area;
+
+	memset(&src, 0, sizeof(src));
+#ifdef LV_IMAGE_HEADER_MAGIC
+	src.header.magic = LV_IMAGE_HEADER_MAGIC;
+#endif
+	src.header.cf = LV_COLOR_FORMAT_RAW;
+	src.data = (const uint8_t *)buf;
+	src.data_size = len;
+
+	if (lv_image_decoder_get_info(&src, &header) != LV_RESULT_OK ||
+	    header.w == 0 || header.h == 0)
+		return (NULL);
+
+	img = lv_draw_buf_create(header.w, header.h,
+	    LV_COLOR_FORMAT_ARGB8888, LV_STRIDE_AUTO);
+	if (img == NULL)
+		return (NULL);
+	lv_draw_buf_clear(img, NULL);
+
+	/* let a canvas drive the decoder, which works for tjpgd too */
+	canvas = lv_canvas_create(lv_layer_sys());
+	if (canvas == NULL) {
+		lv_draw_buf_destroy(img);
+		return (NULL);
 	}
+	lv_obj_add_flag(canvas, LV_OBJ_FLAG_HIDDEN);
+	lv_canvas_set_draw_buf(canvas, img);
 
-	return (NULL);
+	lv_canvas_init_layer(canvas, &layer);
+	lv_draw_image_dsc_init(&dsc);
+	dsc.src = &src;
+	lv_area_set(&area, 0, 0, header.w - 1, header.h - 1);
+	lv_draw_image(&layer, &dsc, &area);
+	lv_canvas_finish_layer(canvas, &layer);
+
+	/* the canvas doesn't own the draw buf */
+	lv_obj_delete(canvas);
+	lv_image_cache_drop(&src);
+
+	return (img);
 }
 
 static void
-wslv_mqtt_on_message(struct mqtt_conn *mc,
-    char *topic, size_t topic_len, char *payload, size_t payload_len,
-    enum mqtt_qos qos)
+wslv_image_sink_set(struct wslv_image_sink *is, char *buf, size_t len)
 {
-	struct wslv_softc *sc = mqtt_cookie(mc);
-	size_t name_len, device_len, cmnd_len, off;
-	const char *name;
-	const char *sep;
-	const struct wslv_mqtt_cmnd *cmnd;
+	lv_obj_t *obj = is->is_obj;
+	lv_draw_buf_t *img;
 
-	if (payload == NULL || *payload == '\0')
-		goto free;
+	if (obj == NULL) {
+		free(buf);
+		return;
+	}
 
-	if (topic_len <= prefix_cmnd_len) /* <= includes '/' */
-		goto decline;
-	if (strncmp(topic, prefix_cmnd, prefix_cmnd_len) != 0)
-		goto decline;
-	off = prefix_cmnd_len;
-	if (topic[off++] != '/')
-		goto decline;
+	if (!wslv_image_sig(buf, len, wslv_png_sig, sizeof(wslv_png_sig)) &&
+	    !wslv_image_sig(buf, len, wslv_jpeg_sig, sizeof(wslv_jpeg_sig))) {
+		warnx("image payload is not a png or jpeg, ignoring");
+		free(buf);
+		return;
+	}
 
-	device_len = strlen(sc->sc_mqtt_device);
-	if (topic_len <= (off + device_len)) /* <= includes '/' */
-		goto decline;
-	if (strncmp(topic + off, sc->sc_mqtt_device, device_len) != 0)
-		goto decline;
-	off += device_len;
-	if (topic[off++] != '/')
-		goto decline;
+	img = wslv_image_decode(buf, len);
+	free(buf);
+	if (img == NULL) {
+		warnx("unable to decode image payload, ignoring");
+		return;
+	}
 
-	name = topic + off;
-	cmnd_len = name_len = topic_len - off;
-	sep = memchr(name, '/', name_len);
-	if (sep != NULL)
-		cmnd_len = sep - name;
-
-	cmnd = wslv_mqtt_cmnd(name, cmnd_len);
-	if (cmnd != NULL)
-		(*cmnd->handler)(sc, name, payload, payload_len);
+	lv_image_set_src(obj, NULL);
+	wslv_image_sink_release(is);
+
+	is->is_img = img;
+	lv_image_set_src(obj, is->is_img);
+}
+
+static void
+wslv_image_sink_count(struct wslv_lua_mqtt_sub *lsub, void *arg)
+{
+	struct wslv_image_feed *f = arg;
+
+	if (lsub->sink != NULL)
+		f->sinks++;
 	else
-		wslv_lua_cmnd(sc, name, name_len, payload, payload_len);
-	goto free;
+		f->others++;
+}
 
-free:
-	free(topic);
-	free(payload);
-	return;
+static void
+wslv_image_sink_feed(struct wslv_lua_mqtt_sub *lsub, void *arg)
+{
+	struct wslv_image_feed *f = arg;
+	char *buf;
 
-decline:
-	wslv_lua_mqtt_message(sc, topic, topic_len, payload, payload_len, qos);
+	if (lsub->sink == NULL)
+		return;
+
+	if (f->give && !f->given) {
+		buf = f->payload;
+		f->given = 1;
+	} else {
+		buf = malloc(f->len);
+		if (buf == NULL) {
+			warn("%s", __func__);
+			return;
+		}
+		memcpy(buf, f->payload, f->len);
+	}
+
+	wslv_image_sink_set(lsub->sink, buf, f->len);
 }
 
-static const char *wslv_idle_state_names[] = {
-	[WSLV_IDLE_STATE_AWAKE] = "awake",
-	[WSLV_IDLE_STATE_DROWSY] = "drowsy",
-	[WSLV_IDLE_STATE_ASLEEP] = "asleep",
+/*
+ * lua binding
+ */
+
+static int
+wslv_lua_panic(lua_State *L)
+{
+	warnx("lua panic: %s", lua_tostring(L, -1));
+	return (0);
+}
+
+/*
+ * lua bytecode cache
+ *
+ * parsing and compiling a big ui script and its modules is a good
+ * part of startup, and it's done again on every reload. if a cache
+ * directory is set with -C, the lua_dump output for each file that
+ * is loaded is kept there and reused while the source is unchanged.
+ *
+ * a cache file is named after a hash of the source path, and starts
+ * with a header holding the path, size, mtime, and a hash of the
+ * content of the source it was compiled from. any mismatch means
+ * the source is compiled again and the cache file replaced.
+ */
+
+#define WSLV_LUAC_MAGIC		"wslvluac"
+
+struct wslv_luac_hdr {
+	char			h_magic[8];
+	uint32_t		h_version;	/* LUA_VERSION_NUM */
+	uint32_t		h_pathlen;
+	uint64_t		h_size;
+	int64_t			h_mtime_sec;
+	int64_t			h_mtime_nsec;
+	uint64_t		h_hash;
+	uint64_t		h_len;		/* of the bytecode */
+	/* followed by the path, and then the bytecode */
 };
 
-static void
-wslv_mqtt_tele(struct wslv_softc *sc)
+struct wslv_luac_buf {
+	char			*b_buf;
+	size_t			 b_len;
+	size_t			 b_off;
+};
+
+static uint64_t
+wslv_luac_hash(const void *buf, size_t len)
 {
-	struct mqtt_conn *mc = sc->sc_mqtt_conn;
-	char topic[128];
-	char payload[256];
-	size_t tlen, plen;
-	int rv;
-	size_t off;
+	const uint8_t *p = buf;
+	uint64_t h = 14695981039346656037ULL; /* fnv-1a */
+	size_t i;
 
-	rv = snprintf(topic, sizeof(topic), "tele/%s/STATUS",
-	    sc->sc_mqtt_device);
-	if (rv == -1)
-		errx(1, "mqtt tele topic");
-	tlen = rv;
-	if (tlen >= sizeof(topic))
-		errx(1, "mqtt tele topic len");
+	for (i = 0; i < len; i++) {
+		h ^= p[i];
+		h *= 1099511628211ULL;
+	}
 
-	rv = snprintf(payload, sizeof(payload),
-	    "{\"idle\":\"%s\",\"screen\":\"%s\",\"state\":\"%s\"",
-	    sc->sc_idle > WSLV_IDLE_STATE_AWAKE ? "ON" : "OFF",
-	    sc->sc_idle < WSLV_IDLE_STATE_ASLEEP ? "ON" : "OFF",
-	    wslv_idle_state_names[sc->sc_idle]);
-	if (rv == -1)
-		errx(1, "mqtt tele payload");
-	plen = rv;
-	if (plen >= sizeof(payload))
-		errx(1, "mqtt tele payload len");
+	return (h);
+}
 
-	if (sc->sc_ws_brightness.param) {
-		rv = snprintf(payload + plen,
-		    sizeof(payload) - plen,
-		    ",\"brightness\":{\"v\":%d,\"min\":%d,\"max\":%d}",
-		    sc->sc_ws_brightness.curval,
-		    sc->sc_ws_brightness.min,
-		    sc->sc_ws_brightness.max);
-		if (rv == -1)
-			errx(1, "mqtt tele payload");
-		plen += rv;
-		if (plen >= sizeof(payload))
-			errx(1, "mqtt tele payload len");
-	}
-
-	rv = snprintf(payload + plen, sizeof(payload) - plen, "}");
-	if (rv == -1)
-		errx(1, "mqtt tele payload");
-	plen += rv;
-	if (plen >= sizeof(payload))
-		errx(1, "mqtt tele payload len");
+static int
+wslv_luac_read(int fd, void *buf, size_t len)
+{
+	char *p = buf;
+	ssize_t rv;
 
-	if (mqtt_publish(mc, topic, tlen, payload, plen,
-	    MQTT_QOS0, MQTT_NORETAIN) == -1)
-		errx(1, "mqtt publish %s", topic);
+	while (len > 0) {
+		rv = read(fd, p, len);
+		if (rv == -1) {
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+		if (rv == 0) {
+			errno = EIO;
+			return (-1);
+		}
+
+		p += rv;
+		len -= rv;
+	}
+
+	return (0);
 }
 
-void
-wslv_tele(struct wslv_softc *sc, const char *suffix, size_t suffix_len,
-    const char *payload, size_t payload_len)
+static int
+wslv_luac_writer(lua_State *L, const void *p, size_t len, void *arg)
 {
-	struct mqtt_conn *mc = sc->sc_mqtt_conn;
-	char topic[128];
-	size_t topic_len;
-	int rv;
+	struct wslv_luac_buf *b = arg;
+	size_t nlen;
+	char *buf;
 
-	rv = snprintf(topic, sizeof(topic), "tele/%s/%s",
-	    sc->sc_mqtt_device, suffix);
-	if (rv == -1)
-		errx(1, "mqtt tele topic");
-	topic_len = rv;
-	if (topic_len >= sizeof(topic)) {
-		warnx("mqtt_tele topic len");
-		return;
+	if (len > b->b_len - b->b_off) {
+		nlen = b->b_len * 2;
+		while (len > nlen - b->b_off)
+			nlen *= 2;
+
+		buf = realloc(b->b_buf, nlen);
+		if (buf == NULL)
+			return (-1);
+
+		b->b_buf = buf;
+		b->b_len = nlen;
 	}
 
-	if (mqtt_publish(mc, topic, topic_len, payload, payload_len,
-	    MQTT_QOS0, MQTT_NORETAIN) == -1)
-		errx(1, "mqtt publish %s", topic);
+	memcpy(b->b_buf + b->b_off, p, len);
+	b->b_off += len;
+
+	return (0);
 }
 
-static void
-wslv_mqtt_tele_period(int nope, short events, void *arg)
+static char *
+wslv_luac_path(struct wslv_softc *sc, const char *path)
 {
-	static const struct timeval rate = { 300, 0 };
-	struct wslv_softc *sc = arg;
+	char *cpath;
 
-	evtimer_add(&sc->sc_mqtt_tele_period, &rate);
+	if (asprintf(&cpath, "%s/%016llx.luac", sc->sc_L_cachedir,
+	    (unsigned long long)wslv_luac_hash(path, strlen(path))) == -1)
+		return (NULL);
 
-	wslv_mqtt_tele(sc);
+	return (cpath);
 }
 
 static void
-wslv_mqtt_screen(struct wslv_softc *sc, const char *name,
-    const char *payload, size_t payload_len)
+wslv_luac_hdr_init(struct wslv_luac_hdr *h, const char *path,
+    const struct stat *st, uint64_t hash)
 {
-	int oscreen = sc->sc_idle < WSLV_IDLE_STATE_ASLEEP;
-	int nscreen;
+	memset(h, 0, sizeof(*h));
+	memcpy(h->h_magic, WSLV_LUAC_MAGIC, sizeof(h->h_magic));
+	h->h_version = LUA_VERSION_NUM;
+	h->h_pathlen = strlen(path);
+	h->h_size = st->st_size;
+	h->h_mtime_sec = st->st_mtim.tv_sec;
+	h->h_mtime_nsec = st->st_mtim.tv_nsec;
+	h->h_hash = hash;
+}
 
-	if (strcasecmp(payload, "on") == 0 ||
-	    strcasecmp(payload, "1") == 0)
-		nscreen = 1;
-	else if (strcasecmp(payload, "off") == 0 ||
-	    strcasecmp(payload, "0") == 0)
-		nscreen = 0;
-	else if (strcasecmp(payload, "toggle") == 0 ||
-	    strcasecmp(payload, "2") == 0)
-		nscreen = !oscreen;
-	else
-		return;
+/* push the cached function for path, or return -1 */
+static int
+wslv_luac_get(struct wslv_softc *sc, lua_State *L, const char *path,
+    const char *chunkname, const struct wslv_luac_hdr *want)
+{
+	struct wslv_luac_hdr h;
+	char *cpath;
+	char *buf = NULL;
+	int fd;
+	int rv = -1;
 
-	if (nscreen) {
-		sc->sc_idle = WSLV_IDLE_STATE_AWAKE;
-		evtimer_add(&sc->sc_idle_ev, &sc->sc_idle_time);
-	} else {
-		sc->sc_idle = WSLV_IDLE_STATE_ASLEEP;
-		evtimer_del(&sc->sc_idle_ev);
-	}
+	cpath = wslv_luac_path(sc, path);
+	if (cpath == NULL)
+		return (-1);
 
-	if (nscreen != oscreen) {
-		if (nscreen) {
-			wslv_svideo(sc, 1);
-			wslv_wake(sc);
-		} else {
-			wslv_sleep(sc);
-		}
+	fd = open(cpath, O_RDONLY);
+	free(cpath);
+	if (fd == -1)
+		return (-1);
+
+	if (wslv_luac_read(fd, &h, sizeof(h)) == -1)
+		goto close;
+
+	/* everything but the bytecode length has to match */
+	if (memcmp(h.h_magic, want->h_magic, sizeof(h.h_magic)) != 0 ||
+	    h.h_version != want->h_version ||
+	    h.h_pathlen != want->h_pathlen ||
+	    h.h_size != want->h_size ||
+	    h.h_mtime_sec != want->h_mtime_sec ||
+	    h.h_mtime_nsec != want->h_mtime_nsec ||
+	    h.h_hash != want->h_hash)
+		goto close;
+
+	buf = malloc(h.h_pathlen + h.h_len);
+	if (buf == NULL)
+		goto close;
+	if (wslv_luac_read(fd, buf, h.h_pathlen + h.h_len) == -1)
+		goto close;
+	if (memcmp(buf, path, h.h_pathlen) != 0)
+		goto close;
+
+	if (luaL_loadbufferx(L, buf + h.h_pathlen, h.h_len,
+	    chunkname, "b") != LUA_OK) {
+		lua_pop(L, 1);
+		goto close;
 	}
 
-	wslv_mqtt_tele(sc);
+	rv = 0;
+close:
+	free(buf);
+	close(fd);
+	return (rv);
 }
 
+/* dump the function at the top of the stack into the cache */
 static void
-wslv_mqtt_brightness(struct wslv_softc *sc, const char *name,
-    const char *payload, size_t payload_len)
+wslv_luac_put(struct wslv_softc *sc, lua_State *L, const char *path,
+    struct wslv_luac_hdr *h)
 {
-	struct wsdisplay_param param;
-	int val;
-	const char *errstr;
+	struct wslv_luac_buf b = { .b_len = 4096 };
+	char *cpath = NULL, *tpath = NULL;
+	int fd = -1;
 
-	if (sc->sc_ws_brightness.param == 0)
+	b.b_buf = malloc(b.b_len);
+	if (b.b_buf == NULL) {
+		warn("%s cache buffer", path);
 		return;
+	}
 
-	val = strtonum(payload,
-	    sc->sc_ws_brightness.min, sc->sc_ws_brightness.max,
-	    &errstr);
-	if (errstr != NULL)
-		goto tele;
+	if (lua_dump(L, wslv_luac_writer, &b, 0) != 0) {
+		warnx("%s: unable to dump bytecode", path);
+		goto free;
+	}
+	h->h_len = b.b_off;
 
-	param = sc->sc_ws_brightness;
-	param.curval = val;
+	cpath = wslv_luac_path(sc, path);
+	if (cpath == NULL ||
+	    asprintf(&tpath, "%s/.luac.XXXXXXXXXX", sc->sc_L_cachedir) == -1) {
+		warn("%s cache path", path);
+		goto free;
+	}
 
-	if (ioctl(sc->sc_ws_fd, WSDISPLAYIO_SETPARAM, &param) == -1) {
-		warn("mqtt set brightness");
-		goto tele;
+	fd = mkstemp(tpath);
+	if (fd == -1) {
+		warn("%s", tpath);
+		goto free;
 	}
 
-	sc->sc_ws_brightness.curval = val;
+	if (write(fd, h, sizeof(*h)) != (ssize_t)sizeof(*h) ||
+	    write(fd, path, h->h_pathlen) != (ssize_t)h->h_pathlen ||
+	    write(fd, b.b_buf, b.b_off) != (ssize_t)b.b_off) {
+		warn("%s write", tpath);
+		unlink(tpath);
+		goto free;
+	}
 
-tele:
-	wslv_mqtt_tele(sc);
-}
+	if (rename(tpath, cpath) == -1) {
+		warn("rename %s to %s", tpath, cpath);
+		unlink(tpath);
+	}
 
-static void
-wslv_mqtt_dead(struct mqtt_conn *mc)
-{
-	errx(1, "%s", __func__);
+free:
+	if (fd != -1)
+		close(fd);
+	free(tpath);
+	free(cpath);
+	free(b.b_buf);
 }
 
-uint32_t
-wslv_ms(void)
+/*
+ * a replacement for luaL_loadfile that goes through the cache and
+ * accounts for the time spent loading.
+ */
+static int
+wslv_lua_load(struct wslv_softc *sc, lua_State *L, const char *path)
 {
-	struct timespec ts;
-	uint64_t rv;
+	struct wslv_luac_hdr h;
+	struct timespec start, end;
+	struct stat st;
+	const char *chunkname;
+	char *src = NULL;
+	size_t len, off = 0;
+	int fd;
+	int status;
 
-	if (clock_gettime(CLOCK_MONOTONIC, &ts) == -1)
+	if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
 		abort();
 
-	rv = (uint64_t)ts.tv_sec * 1000;
-	rv += (uint64_t)ts.tv_nsec / 1000000;
+	chunkname = lua_pushfstring(L, "@%s", path);
 
-	return (rv);
-}
+	fd = open(path, O_RDONLY);
+	if (fd == -1 || fstat(fd, &st) == -1) {
+		lua_pushfstring(L, "cannot open %s: %s", path,
+		    strerror(errno));
+		status = LUA_ERRFILE;
+		goto close;
+	}
 
-const lv_font_t *
-wslv_font_default(void)
-{
-	return (LV_FONT_DEFAULT);
+	len = st.st_size;
+	src = malloc(len > 0 ? len : 1);
+	if (src == NULL) {
+		lua_pushfstring(L, "cannot read %s: %s", path,
+		    strerror(errno));
+		status = LUA_ERRMEM;
+		goto close;
+	}
+
+	if (wslv_luac_read(fd, src, len) == -1) {
+		lua_pushfstring(L, "cannot read %s: %s", path,
+		    strerror(errno));
+		status = LUA_ERRFILE;
+		goto close;
+	}
+
+	if (sc->sc_L_cachedir != NULL) {
+		wslv_luac_hdr_init(&h, path, &st, wslv_luac_hash(src, len));
+		if (wslv_luac_get(sc, L, path, chunkname, &h) == 0) {
+			sc->sc_L_cached++;
+			status = LUA_OK;
+			goto close;
+		}
+	}
+
+	/* skip a utf-8 bom and a #! line like luaL_loadfile */
+	if (len - off >= 3 && memcmp(src + off, "\xef\xbb\xbf", 3) == 0)
+		off += 3;
+	if (len - off >= 1 && src[off] == '#') {
+		while (off < len && src[off] != '\n')
+			off++;
+	}
+
+	status = luaL_loadbufferx(L, src + off, len - off, chunkname, NULL);
+	if (status == LUA_OK && sc->sc_L_cachedir != NULL)
+		wslv_luac_put(sc, L, path, &h);
+
+close:
+	lua_remove(L, -2); /* chunkname */
+	if (fd != -1)
+		close(fd);
+	free(src);
+
+	if (clock_gettime(CLOCK_MONOTONIC, &end) == -1)
+		abort();
+	timespecsub(&end, &start, &end);
+	timespecadd(&sc->sc_L_load_time, &end, &sc->sc_L_load_time);
+	sc->sc_L_loads++;
+
+	return (status);
 }
 
 /*
- * lua binding
+ * sits in front of the stock lua file searcher in package.searchers
+ * so modules found on package.path are loaded through the cache too.
  */
-
 static int
-wslv_lua_panic(lua_State *L)
+wslv_lua_searcher(lua_State *L)
 {
-	warnx("lua panic: %s", lua_tostring(L, -1));
-	return (0);
+	const char *name = luaL_checkstring(L, 1);
+	const char *path;
+
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "searchpath");
+	lua_pushvalue(L, 1);
+	lua_getfield(L, -3, "path");
+	lua_call(L, 2, 2);
+	if (lua_isnil(L, -2))
+		return (1); /* the list of files searchpath tried */
+	lua_pop(L, 1);
+
+	path = lua_tostring(L, -1);
+	if (wslv_lua_load(sc, L, path) != LUA_OK) {
+		return luaL_error(L,
+		    "error loading module '%s' from file '%s':\n\t%s",
+		    name, path, lua_tostring(L, -1));
+	}
+
+	lua_insert(L, -2);
+	return (2); /* the loader and the path it came from */
+}
+
+static void
+wslv_lua_searcher_init(lua_State *L)
+{
+	lua_Integer i;
+
+	lua_getglobal(L, "package");
+	lua_getfield(L, -1, "searchers");
+
+	/* package.preload stays at 1, the stock lua searcher was at 2 */
+	for (i = luaL_len(L, -1); i >= 2; i--) {
+		lua_rawgeti(L, -1, i);
+		lua_rawseti(L, -2, i + 1);
+	}
+	lua_pushcfunction(L, wslv_lua_searcher);
+	lua_rawseti(L, -2, 2);
+
+	lua_pop(L, 2);
+}
+
+static long long
+wslv_timespec_us(const struct timespec *ts)
+{
+	return ((long long)ts->tv_sec * 1000000 + ts->tv_nsec / 1000);
 }
 
 static void
 wslv_lua_init(struct wslv_softc *sc)
 {
 	const char *lfile = sc->sc_L_script;
+	struct timespec start, end;
 	lua_State *L;
 	int status;
 
@@ -1609,9 +4219,16 @@ wslv_lua_init(struct wslv_softc *sc)
 	luaL_requiref(L, "lv", luaopen_lv, 1);
 	lua_pop(L, 1);
 
+	luaL_requiref(L, "json", luaopen_json, 1);
+	lua_pop(L, 1);
+
 	wslv_luaopen(sc, L); /* wslv.tele etc */
+	wslv_lua_searcher_init(L);
+
+	timespecclear(&sc->sc_L_load_time);
+	sc->sc_L_loads = sc->sc_L_cached = 0;
 
-	status = luaL_loadfile(L, lfile);
+	status = wslv_lua_load(sc, L, lfile);
 	if (status != 0) {
 		switch (status) {
 		case LUA_ERRSYNTAX:
@@ -1623,8 +4240,8 @@ wslv_lua_init(struct wslv_softc *sc)
 			    lfile);
 			break;
 		case LUA_ERRFILE:
-			warnx("unable to load %s: open or read failure",
-			    lfile);
+			warnx("unable to load %s: %s", lfile,
+			    lua_tostring(L, -1));
 			break;
 		default:
 			warnx("unable to load %s: error %d", lfile, status);
@@ -1633,7 +4250,11 @@ wslv_lua_init(struct wslv_softc *sc)
 		goto close;
 	}
 
+	if (clock_gettime(CLOCK_MONOTONIC, &start) == -1)
+		abort();
 	status = lua_pcall(L, 0, 0, 0);
+	if (clock_gettime(CLOCK_MONOTONIC, &end) == -1)
+		abort();
 	if (status != 0) {
 		switch (status) {
 		case LUA_ERRRUN:
@@ -1650,6 +4271,13 @@ wslv_lua_init(struct wslv_softc *sc)
 		goto close;
 	}
 
+	/* the run time includes loading anything the script requires */
+	timespecsub(&end, &start, &end);
+	fprintf(stderr, "%s: %u files loaded in %lldus (%u cached), "
+	    "run in %lldus\n", lfile, sc->sc_L_loads,
+	    wslv_timespec_us(&sc->sc_L_load_time), sc->sc_L_cached,
+	    wslv_timespec_us(&end));
+
 	sc->sc_L = L;
 	return;
 
@@ -1670,6 +4298,21 @@ wslv_lua_mqtt_sub_rele(struct wslv_lua_mqtt_sub *lsub)
 	}
 }
 
+static void
+wslv_lua_cmnds_clear(struct wslv_softc *sc)
+{
+	struct wslv_cmnds *cs = &sc->sc_cmnds;
+	struct wslv_cmnd *c, *nc;
+	unsigned int i;
+
+	for (i = 0; i <= cs->cs_mask; i++) {
+		SLIST_FOREACH_SAFE(c, &cs->cs_buckets[i], c_entry, nc) {
+			if (c->c_builtin == NULL)
+				wslv_cmnd_remove(sc, c);
+		}
+	}
+}
+
 static void
 wslv_lua_reload(struct wslv_softc *sc)
 {
@@ -1682,19 +4325,78 @@ wslv_lua_reload(struct wslv_softc *sc)
 		lua_close(L);
 	}
 
-	TAILQ_FOREACH(lsub, &sc->sc_L_subs, entry) {
+	wslv_lua_cmnds_clear(sc);
+	wslv_lua_mqtt_pend_clear(sc);
+	wslv_pub_policies_clear(sc);
+
+	while ((lsub = TAILQ_FIRST(&sc->sc_L_subs)) != NULL) {
+		TAILQ_REMOVE(&sc->sc_L_subs, lsub, entry);
+		wslv_topic_remove(lsub);
 		lsub->handler = LUA_NOREF;
+		if (lsub->sink != NULL) {
+			wslv_image_sink_free(sc, lsub->sink);
+			lsub->sink = NULL;
+		}
+
+		if (sc->sc_mqtt_state != WSLV_MQTT_S_CONNECTED) {
+			wslv_lua_mqtt_sub_rele(lsub);
+			continue;
+		}
 
 		/* give this ref to unsub */
 		if (mqtt_unsubscribe(mc, lsub,
-		    lsub->filter, lsub->len) == -1)
-			errx(1, "lsub %s unsub", lsub->filter);
+		    lsub->filter, lsub->len) == -1) {
+			warnx("lsub %s unsub", lsub->filter);
+			wslv_lua_mqtt_sub_rele(lsub);
+			continue;
+		}
+
+		TAILQ_INSERT_TAIL(&sc->sc_L_unsubs, lsub, entry);
 	}
-	TAILQ_INIT(&sc->sc_L_subs);
 
 	wslv_lua_init(sc);
 }
 
+/*
+ * the broker connection has been (re)established, so put the
+ * subscriptions the script asked for back in place.
+ */
+static void
+wslv_lua_mqtt_connected(struct wslv_softc *sc)
+{
+	struct mqtt_conn *mc = sc->sc_mqtt_conn;
+	struct wslv_lua_mqtt_sub *lsub;
+
+	TAILQ_FOREACH(lsub, &sc->sc_L_subs, entry) {
+		if (mqtt_subscribe(mc, lsub,
+		    lsub->filter, lsub->len, lsub->qos) == -1) {
+			warnx("lsub %s resubscribe", lsub->filter);
+			continue;
+		}
+
+		lsub->refs++; /* for amqtt */
+	}
+}
+
+/*
+ * amqtt forgets about everything it was holding when the connection
+ * goes away, so take back the refs it had on the subscriptions.
+ */
+static void
+wslv_lua_mqtt_disconnected(struct wslv_softc *sc)
+{
+	struct wslv_lua_mqtt_sub *lsub;
+
+	TAILQ_FOREACH(lsub, &sc->sc_L_subs, entry)
+		lsub->refs = 1;
+
+	while ((lsub = TAILQ_FIRST(&sc->sc_L_unsubs)) != NULL) {
+		TAILQ_REMOVE(&sc->sc_L_unsubs, lsub, entry);
+		free(lsub->filter);
+		free(lsub);
+	}
+}
+
 static void
 wslv_lua_reload_cb(lv_event_t *e)
 {
@@ -1712,6 +4414,7 @@ wslv_lua_clocktick(int nil, short events, void *arg)
 	int top;
 	int rv;
 
+	wslv_wakeup(sc);
 	evtimer_add(&sc->sc_clocktick, &rate);
 
 	if (L == NULL)
@@ -1732,7 +4435,8 @@ pop:
 }
 
 static void
-wslv_lua_cmnd(struct wslv_softc *sc, const char *topic, size_t topic_len,
+wslv_lua_cmnd(struct wslv_softc *sc, int handler,
+    const char *topic, size_t topic_len,
     const char *payload, size_t payload_len)
 {
 	lua_State *L = sc->sc_L;
@@ -1744,7 +4448,11 @@ wslv_lua_cmnd(struct wslv_softc *sc, const char *topic, size_t topic_len,
 
 	top = lua_gettop(L);
 
-	lua_getglobal(L, "cmnd");
+	/* commands without a wslv.on_cmnd() handler go to cmnd() */
+	if (handler == LUA_NOREF)
+		lua_getglobal(L, "cmnd");
+	else
+		lua_rawgeti(L, LUA_REGISTRYINDEX, handler);
 	if (!lua_isfunction(L, -1))
 		goto pop;
 
@@ -1766,20 +4474,44 @@ static int
 wslv_luaL_publish(lua_State *L)
 {
 	struct wslv_softc *sc = &_wslv; /* XXX */
-	struct mqtt_conn *mc = sc->sc_mqtt_conn;
 	const char *topic, *payload;
 	size_t topic_len, payload_len;
 
+	enum mqtt_qos qos;
+	int retain;
+
 	topic = lua_tolstring(L, 1, &topic_len);
-	payload = lua_tolstring(L, 2, &payload_len);
+	payload = wslv_lua_payload(L, 2, &payload_len);
+	qos = wslv_lua_checkqos(L, 3);
+	retain = lua_toboolean(L, 4) ? MQTT_RETAIN : MQTT_NORETAIN;
 
-	if (mqtt_publish(mc, topic, topic_len, payload, payload_len,
-	    MQTT_QOS0, MQTT_NORETAIN) == -1)
-		errx(1, "mqtt publish %s", topic);
+	if (wslv_pub(sc, topic, topic_len, payload, payload_len,
+	    qos, retain) == -1)
+		warnx("mqtt publish %s", topic);
 
 	return (0);
 }
 
+/* the wire qos levels, which are what lua uses and what suback grants */
+static const enum mqtt_qos wslv_mqtt_qos[] = {
+	MQTT_QOS0,
+	MQTT_QOS1,
+	MQTT_QOS2,
+};
+
+static unsigned int
+wslv_mqtt_qos_level(enum mqtt_qos qos)
+{
+	unsigned int i;
+
+	for (i = 0; i < nitems(wslv_mqtt_qos); i++) {
+		if (wslv_mqtt_qos[i] == qos)
+			break;
+	}
+
+	return (i);
+}
+
 static void
 wslv_lua_mqtt_suback(struct wslv_softc *sc, void *cookie,
     const uint8_t *rcodes, size_t nrcodes)
@@ -1795,11 +4527,14 @@ wslv_lua_mqtt_suback(struct wslv_softc *sc, void *cookie,
 	rcode = rcodes[0];
 	switch (rcode) {
 	case 0x00:
-		break;
 	case 0x01:
 	case 0x02:
-		warnx("%s suback, unexpected success rcode 0x%02x",
-		    lsub->filter, rcode);
+		/* the rcode is the qos level the broker granted */
+		if (rcode < wslv_mqtt_qos_level(lsub->qos)) {
+			warnx("%s suback, granted qos %u instead of %u",
+			    lsub->filter, (unsigned int)rcode,
+			    wslv_mqtt_qos_level(lsub->qos));
+		}
 		break;
 	case 0x80:
 		warnx("%s suback failed", lsub->filter);
@@ -1819,31 +4554,133 @@ wslv_lua_mqtt_unsuback(struct wslv_softc *sc, void *cookie)
 {
 	struct wslv_lua_mqtt_sub *lsub = cookie;
 
+	TAILQ_REMOVE(&sc->sc_L_unsubs, lsub, entry);
 	wslv_lua_mqtt_sub_rele(lsub);
 }
 
+struct wslv_lua_mqtt_dispatch {
+	lua_State			*L;
+	int				 args;
+	const char			*topic;
+	unsigned int			 handlers;
+	unsigned int			 deferred;
+	int				 fallback;
+	int				 frame; /* delivering conflated msgs */
+};
+
+static void
+wslv_lua_mqtt_dispatch(struct wslv_lua_mqtt_sub *lsub, void *arg)
+{
+	struct wslv_lua_mqtt_dispatch *d = arg;
+	lua_State *L = d->L;
+	int rv;
+
+	if (lsub->sink != NULL) {
+		/* wslv_image_sink_feed has already dealt with it */
+		d->handlers++;
+		return;
+	}
+
+	if (lsub->handler == LUA_NOREF) {
+		d->fallback = 1;
+		return;
+	}
+
+	if (lsub->conflate != d->frame) {
+		if (lsub->conflate)
+			d->deferred++;
+		return;
+	}
+
+	d->handlers++;
+
+	lua_rawgeti(L, LUA_REGISTRYINDEX, lsub->handler);
+	lua_pushvalue(L, d->args);
+	lua_pushvalue(L, d->args + 1);
+	lua_pushvalue(L, d->args + 2);
+
+	rv = lua_pcall(L, 3, 0, 0);
+	if (rv != 0) {
+		warnx("lua pcall %s handler %s", lsub->filter,
+		    lua_tostring(L, -1));
+		lua_pop(L, 1);
+	}
+}
+
+/*
+ * messages go to the handlers given to wslv.subscribe() for the
+ * filters they match. mqtt_message() gets anything matching a
+ * subscription without a handler, or nothing at all.
+ */
 static void
 wslv_lua_mqtt_message(struct wslv_softc *sc,
     char *topic, size_t topiclen, char *payload, size_t payloadlen, int qos)
 {
 	lua_State *L = sc->sc_L;
+	struct wslv_lua_mqtt_dispatch d;
 	int top;
 	int rv;
 
-	struct wslv_lua_mqtt_sub *lsub;
+	if (sc->sc_image_sinks > 0) {
+		struct wslv_image_feed f = {
+			.payload = payload,
+			.len = payloadlen,
+		};
+
+		wslv_topic_match(sc->sc_L_topics, topic, topiclen,
+		    wslv_image_sink_count, &f);
+		if (f.sinks > 0) {
+			/* nothing else wants it, so give it away */
+			f.give = (f.others == 0);
+			wslv_topic_match(sc->sc_L_topics, topic, topiclen,
+			    wslv_image_sink_feed, &f);
+			if (f.given)
+				payload = NULL;
+			if (f.others == 0)
+				goto free;
+		}
+	}
+
+	wslv_last_update(sc, topic, topiclen, payload, payloadlen);
 
 	if (L == NULL)
 		goto free;
 
 	top = lua_gettop(L);
 
+	lua_pushlstring(L, topic, topiclen);
+	lua_pushlstring(L, payload, payloadlen);
+	lua_pushinteger(L, wslv_mqtt_qos_level(qos));
+
+	d.L = L;
+	d.args = top + 1;
+	d.handlers = 0;
+	d.deferred = 0;
+	d.fallback = 0;
+	d.frame = 0;
+
+	sc->sc_L_in_cmnd = 1;
+	wslv_topic_match(sc->sc_L_topics, topic, topiclen,
+	    wslv_lua_mqtt_dispatch, &d);
+	sc->sc_L_in_cmnd = 0;
+
+	if (d.deferred > 0) {
+		/* the pending list owns the topic and payload now */
+		wslv_lua_mqtt_pend(sc, topic, topiclen, payload, payloadlen,
+		    qos);
+		topic = payload = NULL;
+	}
+
+	if ((d.handlers > 0 || d.deferred > 0) && !d.fallback)
+		goto pop;
+
 	lua_getglobal(L, "mqtt_message");
 	if (!lua_isfunction(L, -1))
 		goto pop;
 
-	lua_pushlstring(L, topic, topiclen);
-	lua_pushlstring(L, payload, payloadlen);
-	lua_pushinteger(L, qos);
+	lua_pushvalue(L, top + 1);
+	lua_pushvalue(L, top + 2);
+	lua_pushvalue(L, top + 3);
 
 	sc->sc_L_in_cmnd = 1;
 	rv = lua_pcall(L, 3, 0, 0);
@@ -1859,23 +4696,235 @@ free:
 	free(payload);
 }
 
+/*
+ * nil is sent as an empty payload, tables and booleans as json, and
+ * anything else as a string.
+ */
+static const char *
+wslv_lua_payload(lua_State *L, int idx, size_t *len)
+{
+	switch (lua_type(L, idx)) {
+	case LUA_TNONE:
+	case LUA_TNIL:
+		/* an empty payload, eg, to clear a retained topic */
+		*len = 0;
+		return ("");
+	case LUA_TTABLE:
+	case LUA_TBOOLEAN:
+		return (lua_json_encode(L, idx, len));
+	default:
+		break;
+	}
+
+	return (luaL_checklstring(L, idx, len));
+}
+
+/* an optional qos argument, defaulting to 0 */
+static enum mqtt_qos
+wslv_lua_checkqos(lua_State *L, int arg)
+{
+	lua_Integer qos;
+
+	qos = luaL_optinteger(L, arg, 0);
+	luaL_argcheck(L, qos >= 0 && qos < (lua_Integer)nitems(wslv_mqtt_qos),
+	    arg, "qos must be 0, 1, or 2");
+
+	return (wslv_mqtt_qos[qos]);
+}
+
+static inline int
+wslv_lua_mqtt_pend_cmp(const struct wslv_lua_mqtt_pend *a,
+    const struct wslv_lua_mqtt_pend *b)
+{
+	size_t len = MIN(a->topic_len, b->topic_len);
+	int rv;
+
+	rv = memcmp(a->topic, b->topic, len);
+	if (rv != 0)
+		return (rv);
+
+	if (a->topic_len > b->topic_len)
+		return (1);
+	if (a->topic_len < b->topic_len)
+		return (-1);
+
+	return (0);
+}
+
+RBT_GENERATE(wslv_lua_mqtt_pend_tree, wslv_lua_mqtt_pend, rbentry,
+    wslv_lua_mqtt_pend_cmp);
+
+/*
+ * hold a message for a conflating subscription until the next frame.
+ * a newer message on the same topic replaces the one that is waiting,
+ * but keeps its place in the delivery order.
+ */
+static void
+wslv_lua_mqtt_pend(struct wslv_softc *sc,
+    char *topic, size_t topiclen, char *payload, size_t payloadlen, int qos)
+{
+	struct wslv_lua_mqtt_pend key, *lp;
+
+	key.topic = topic;
+	key.topic_len = topiclen;
+	lp = RBT_FIND(wslv_lua_mqtt_pend_tree, &sc->sc_L_pend_tree, &key);
+	if (lp != NULL) {
+		sc->sc_L_conflated++;
+
+		free(lp->payload);
+		lp->payload = payload;
+		lp->payload_len = payloadlen;
+		lp->qos = qos;
+
+		free(topic);
+		return;
+	}
+
+	lp = wslv_pool_get(sc, sizeof(*lp));
+	if (lp == NULL) {
+		warn("%s", __func__);
+		sc->sc_L_conflated++;
+		free(topic);
+		free(payload);
+		return;
+	}
+
+	lp->topic = topic;
+	lp->topic_len = topiclen;
+	lp->payload = payload;
+	lp->payload_len = payloadlen;
+	lp->qos = qos;
+
+	RBT_INSERT(wslv_lua_mqtt_pend_tree, &sc->sc_L_pend_tree, lp);
+	TAILQ_INSERT_TAIL(&sc->sc_L_pend_list, lp, entry);
+}
+
+static void
+wslv_lua_mqtt_pend_free(struct wslv_softc *sc, struct wslv_lua_mqtt_pend *lp)
+{
+	free(lp->topic);
+	free(lp->payload);
+	wslv_pool_put(sc, lp, sizeof(*lp));
+}
+
+static void
+wslv_lua_mqtt_pend_clear(struct wslv_softc *sc)
+{
+	struct wslv_lua_mqtt_pend *lp;
+
+	while ((lp = TAILQ_FIRST(&sc->sc_L_pend_list)) != NULL) {
+		TAILQ_REMOVE(&sc->sc_L_pend_list, lp, entry);
+		RBT_REMOVE(wslv_lua_mqtt_pend_tree, &sc->sc_L_pend_tree, lp);
+		wslv_lua_mqtt_pend_free(sc, lp);
+	}
+}
+
+/*
+ * called once a frame before lvgl runs, so the handlers of conflating
+ * subscriptions only see the latest value on each topic.
+ */
+static void
+wslv_lua_mqtt_deliver(struct wslv_softc *sc)
+{
+	lua_State *L = sc->sc_L;
+	struct wslv_lua_mqtt_pend_list list;
+	struct wslv_lua_mqtt_pend *lp;
+	struct wslv_lua_mqtt_dispatch d;
+	int top;
+
+	if (TAILQ_EMPTY(&sc->sc_L_pend_list))
+		return;
+	if (L == NULL) {
+		wslv_lua_mqtt_pend_clear(sc);
+		return;
+	}
+
+	/* messages that arrive while the handlers run wait a frame */
+	TAILQ_INIT(&list);
+	TAILQ_CONCAT(&list, &sc->sc_L_pend_list, entry);
+	RBT_INIT(wslv_lua_mqtt_pend_tree, &sc->sc_L_pend_tree);
+
+	while ((lp = TAILQ_FIRST(&list)) != NULL) {
+		TAILQ_REMOVE(&list, lp, entry);
+
+		top = lua_gettop(L);
+
+		lua_pushlstring(L, lp->topic, lp->topic_len);
+		lua_pushlstring(L, lp->payload, lp->payload_len);
+		lua_pushinteger(L, wslv_mqtt_qos_level(lp->qos));
+
+		d.L = L;
+		d.args = top + 1;
+		d.handlers = 0;
+		d.deferred = 0;
+		d.fallback = 0;
+		d.frame = 1;
+
+		sc->sc_L_in_cmnd = 1;
+		wslv_topic_match(sc->sc_L_topics, lp->topic, lp->topic_len,
+		    wslv_lua_mqtt_dispatch, &d);
+		sc->sc_L_in_cmnd = 0;
+
+		lua_settop(L, top);
+		wslv_lua_mqtt_pend_free(sc, lp);
+	}
+}
+
 static int
 wslv_luaL_subscribe(lua_State *L)
 {
 	struct wslv_softc *sc = &_wslv; /* XXX */
-	struct mqtt_conn *mc = sc->sc_mqtt_conn;
 	struct wslv_lua_mqtt_sub *lsub;
 	const char *filter;
 	size_t len;
+	const char *errstr;
+	int conflate = 0;
+	enum mqtt_qos qos = MQTT_QOS0;
+	lua_Integer lqos;
+	int isnum;
+	lv_obj_t *image = NULL;
 
 	filter = luaL_checklstring(L, 1, &len);
+	if (wslv_mqtt_check_filter(filter, len, &errstr) == -1)
+		return luaL_argerror(L, 1, errstr);
+	luaL_argcheck(L, lua_isnoneornil(L, 2) || lua_isfunction(L, 2), 2,
+	    "handler must be a function");
+	if (!lua_isnoneornil(L, 3)) {
+		luaL_checktype(L, 3, LUA_TTABLE);
+		lua_getfield(L, 3, "conflate");
+		conflate = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+		if (lua_getfield(L, 3, "qos") != LUA_TNIL) {
+			lqos = lua_tointegerx(L, -1, &isnum);
+			if (!isnum || lqos < 0 ||
+			    lqos >= (lua_Integer)nitems(wslv_mqtt_qos))
+				return luaL_argerror(L, 3, "invalid qos");
+			qos = wslv_mqtt_qos[lqos];
+		}
+		lua_pop(L, 1);
+		if (lua_getfield(L, 3, "image") != LUA_TNIL) {
+			image = lua_lv_checkobj(L, lua_gettop(L),
+			    &lv_image_class);
+			luaL_argcheck(L, lua_isnoneornil(L, 2), 2,
+			    "image subscriptions dont take a handler");
+		}
+		lua_pop(L, 1);
+	}
+
+	if (sc->sc_L_topics == NULL) {
+		sc->sc_L_topics = wslv_topic_node_alloc(NULL, NULL, 0);
+		if (sc->sc_L_topics == NULL) {
+			return luaL_error(L, "wslv topic trie alloc: %s",
+			    strerror(errno));
+		}
+	}
 
 	lsub = malloc(sizeof(*lsub));
 	if (lsub == NULL) {
 		return luaL_error(L, "wslv_lua_mqtt_sub alloc: %s",
 		    strerror(errno));
 	}
-	lsub->filter = malloc(len);
+	lsub->filter = malloc(len + 1);
 	if (lsub->filter == NULL) {
 		int serrno = errno;
 		free(lsub);
@@ -1884,20 +4933,55 @@ wslv_luaL_subscribe(lua_State *L)
 	}
 
 	memcpy(lsub->filter, filter, len);
+	lsub->filter[len] = '\0';
 	lsub->len = len;
-
+	lsub->node = NULL;
 	lsub->handler = LUA_NOREF;
-	if (lua_isfunction(L, 2)) {
-		lua_pushvalue(L, 2);
-		lsub->len = luaL_ref(L, LUA_REGISTRYINDEX);
+	lsub->refs = 1; /* for sc */
+	lsub->conflate = conflate;
+	lsub->qos = qos;
+	lsub->sink = NULL;
+
+	if (image != NULL) {
+		lsub->sink = wslv_image_sink_create(sc, image);
+		if (lsub->sink == NULL) {
+			int serrno = errno;
+			free(lsub->filter);
+			free(lsub);
+			return luaL_error(L, "wslv image sink alloc: %s",
+			    strerror(serrno));
+		}
 	}
 
-	lsub->refs = 2; /* one for amqtt, one for sc */
-
-	if (mqtt_subscribe(mc, lsub, filter, len, MQTT_QOS0) == -1) {
+	if (wslv_topic_insert(sc->sc_L_topics, lsub) == -1) {
+		int serrno = errno;
+		wslv_topic_remove(lsub);
+		if (lsub->sink != NULL)
+			wslv_image_sink_free(sc, lsub->sink);
 		free(lsub->filter);
 		free(lsub);
-		return luaL_error(L, "mqtt subscribe %s failed", filter);
+		return luaL_error(L, "wslv topic trie insert: %s",
+		    strerror(serrno));
+	}
+
+	/* if the broker isnt there yet, wslv_lua_mqtt_connected will do it */
+	if (sc->sc_mqtt_state == WSLV_MQTT_S_CONNECTED) {
+		if (mqtt_subscribe(sc->sc_mqtt_conn, lsub,
+		    filter, len, lsub->qos) == -1) {
+			wslv_topic_remove(lsub);
+			if (lsub->sink != NULL)
+				wslv_image_sink_free(sc, lsub->sink);
+			free(lsub->filter);
+			free(lsub);
+			return luaL_error(L, "mqtt subscribe %s failed",
+			    filter);
+		}
+		lsub->refs++; /* for amqtt */
+	}
+
+	if (lua_isfunction(L, 2)) {
+		lua_pushvalue(L, 2);
+		lsub->handler = luaL_ref(L, LUA_REGISTRYINDEX);
 	}
 
 	TAILQ_INSERT_TAIL(&sc->sc_L_subs, lsub, entry);
@@ -1912,10 +4996,155 @@ wslv_luaL_tele(lua_State *L)
 	const char *topic, *payload;
 	size_t topic_len, payload_len;
 
+	enum mqtt_qos qos;
+
 	topic = lua_tolstring(L, 1, &topic_len);
-	payload = lua_tolstring(L, 2, &payload_len);
+	payload = wslv_lua_payload(L, 2, &payload_len);
+	qos = wslv_lua_checkqos(L, 3);
+
+	wslv_tele(sc, topic, topic_len, payload, payload_len, qos);
+
+	return (0);
+}
+
+static int
+wslv_lua_pub_policy(lua_State *L, const char *topic, size_t len)
+{
+	struct wslv_softc *sc = &_wslv; /* XXX */
+	struct wslv_pub_policy *p;
+	lua_Integer interval = 0, inflight = 0;
+	int dedup;
+
+	if (lua_isnoneornil(L, 2)) {
+		p = wslv_pub_policy_lookup(sc, topic, len);
+		if (p != NULL)
+			wslv_pub_policy_free(sc, p);
+		return (0);
+	}
+
+	luaL_checktype(L, 2, LUA_TTABLE);
+
+	if (lua_getfield(L, 2, "interval") != LUA_TNIL)
+		interval = luaL_checkinteger(L, -1);
+	lua_pop(L, 1);
+	luaL_argcheck(L, interval >= 0 && interval <= 3600000, 2,
+	    "interval out of range");
+
+	if (lua_getfield(L, 2, "inflight") != LUA_TNIL)
+		inflight = luaL_checkinteger(L, -1);
+	lua_pop(L, 1);
+	luaL_argcheck(L, inflight >= 0 && inflight <= 1024, 2,
+	    "inflight out of range");
+
+	lua_getfield(L, 2, "dedup");
+	dedup = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+
+	p = wslv_pub_policy_get(sc, topic, len);
+	if (p == NULL)
+		return luaL_error(L, "publish policy alloc: %s",
+		    strerror(errno));
+
+	p->p_interval = interval;
+	p->p_inflight_max = inflight;
+	p->p_dedup = dedup;
+
+	/* the limits may have been relaxed */
+	evtimer_del(&p->p_ev);
+	wslv_pub_kick(p);
+
+	return (0);
+}
+
+static int
+wslv_luaL_publish_policy(lua_State *L)
+{
+	const char *topic;
+	size_t len;
+
+	topic = luaL_checklstring(L, 1, &len);
+	luaL_argcheck(L, len > 0, 1, "topic is empty");
+
+	return (wslv_lua_pub_policy(L, topic, len));
+}
+
+static int
+wslv_luaL_tele_policy(lua_State *L)
+{
+	struct wslv_softc *sc = &_wslv; /* XXX */
+	char topic[128];
+	const char *suffix;
+	int rv;
 
-	wslv_tele(sc, topic, topic_len, payload, payload_len);
+	suffix = luaL_checkstring(L, 1);
+
+	rv = snprintf(topic, sizeof(topic), "tele/%s/%s",
+	    sc->sc_mqtt_device, suffix);
+	if (rv == -1 || (size_t)rv >= sizeof(topic))
+		return luaL_argerror(L, 1, "topic too long");
+
+	return (wslv_lua_pub_policy(L, topic, rv));
+}
+
+static int
+wslv_luaL_last(lua_State *L)
+{
+	struct wslv_softc *sc = &_wslv; /* XXX */
+	struct wslv_last *l;
+	const char *topic;
+	size_t len;
+
+	topic = luaL_checklstring(L, 1, &len);
+
+	l = wslv_last_lookup(sc, topic, len);
+	if (l == NULL)
+		lua_pushnil(L);
+	else
+		lua_pushlstring(L, l->l_payload, l->l_payload_len);
+	return (1);
+}
+
+static int
+wslv_luaL_on_cmnd(lua_State *L)
+{
+	struct wslv_softc *sc = &_wslv; /* XXX */
+	struct wslv_cmnd *c;
+	const char *name;
+	size_t len;
+	int handler;
+
+	name = luaL_checklstring(L, 1, &len);
+	luaL_argcheck(L, len > 0, 1, "command name is empty");
+	luaL_argcheck(L, lua_isnoneornil(L, 2) || lua_isfunction(L, 2), 2,
+	    "handler must be a function");
+
+	c = wslv_cmnd_lookup(sc, name, len);
+	if (c != NULL) {
+		if (c->c_builtin != NULL)
+			return luaL_error(L, "%s is a builtin command", name);
+
+		luaL_unref(L, LUA_REGISTRYINDEX, c->c_handler);
+		if (lua_isnoneornil(L, 2)) {
+			wslv_cmnd_remove(sc, c);
+			return (0);
+		}
+
+		lua_pushvalue(L, 2);
+		c->c_handler = luaL_ref(L, LUA_REGISTRYINDEX);
+		return (0);
+	}
+
+	if (lua_isnoneornil(L, 2))
+		return (0);
+
+	lua_pushvalue(L, 2);
+	handler = luaL_ref(L, LUA_REGISTRYINDEX);
+
+	if (wslv_cmnd_insert(sc, name, len, NULL, handler) == NULL) {
+		luaL_unref(L, LUA_REGISTRYINDEX, handler);
+		return luaL_error(L, "cmnd %s alloc: %s", name,
+		    strerror(errno));
+	}
 
 	return (0);
 }
@@ -1964,10 +5193,67 @@ wslv_luaL_brightness(lua_State *L)
 	return (3);
 }
 
+static int
+wslv_luaL_tele_period(lua_State *L)
+{
+	struct wslv_softc *sc = &_wslv; /* XXX */
+	lua_Integer secs;
+
+	switch (lua_gettop(L)) {
+	case 1:
+		secs = luaL_checkinteger(L, 1);
+		luaL_argcheck(L, secs >= WSLV_TELE_PERIOD_MIN &&
+		    secs <= WSLV_TELE_PERIOD_MAX, 1, "period out of range");
+		wslv_tele_set_period(sc, secs);
+		break;
+	case 0:
+		break;
+	default:
+		return luaL_error(L, "invalid number of arguments");
+	}
+
+	lua_pushinteger(L, sc->sc_tele_secs);
+	return (1);
+}
+
+static int
+wslv_luaL_tele_metrics(lua_State *L)
+{
+	struct wslv_softc *sc = &_wslv; /* XXX */
+	unsigned int metrics = 0;
+	unsigned int i, n;
+	int top = lua_gettop(L);
+	int arg;
+
+	if (top > 0) {
+		for (arg = 1; arg <= top; arg++) {
+			metrics |= 1U << luaL_checkoption(L, arg, NULL,
+			    wslv_tele_metric_names);
+		}
+		sc->sc_tele_metrics = metrics;
+	}
+
+	n = 0;
+	for (i = 0; wslv_tele_metric_names[i] != NULL; i++) {
+		if (sc->sc_tele_metrics & (1U << i)) {
+			lua_pushstring(L, wslv_tele_metric_names[i]);
+			n++;
+		}
+	}
+
+	return (n);
+}
+
 static const luaL_Reg wslv_luaL[] = {
 	{ "publish",		wslv_luaL_publish },
 	{ "subscribe",		wslv_luaL_subscribe },
+	{ "last",		wslv_luaL_last },
 	{ "tele",		wslv_luaL_tele },
+	{ "publish_policy",	wslv_luaL_publish_policy },
+	{ "tele_policy",	wslv_luaL_tele_policy },
+	{ "tele_period",	wslv_luaL_tele_period },
+	{ "tele_metrics",	wslv_luaL_tele_metrics },
+	{ "on_cmnd",		wslv_luaL_on_cmnd },
 	{ "in_cmnd",		wslv_luaL_in_cmnd },
 	{ "brightness",		wslv_luaL_brightness },
 